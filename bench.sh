@@ -0,0 +1,127 @@
+#!/bin/bash
+#
+# Runs the benchmark programs with each garbage collector, and prints the elapsed time and the GC
+# statistics (see MINILISP_GC_STATS) for each run.
+
+collectors="copying incremental compact"
+
+function bench() {
+  for gc in $collectors; do
+    start=$(date +%s%N)
+    stats=$(echo "$2" | MINILISP_GC=$gc MINILISP_GC_STATS=1 ./minilisp 2>&1 > /dev/null)
+    end=$(date +%s%N)
+    echo "$1 $gc: $(( (end - start) / 1000000 )) ms"
+    echo "  $stats"
+  done
+}
+
+bench nqueens "$(cat examples/nqueens.lisp)"
+
+# Allocates a lot of short-lived objects while a small amount of data stays alive.
+bench garbage "
+  (defun iota (m n) (if (< m n) (cons m (iota (+ m 1) n)) ()))
+  (define live (iota 0 100))
+  (define i 0)
+  (while (< i 50000)
+    (setq i (+ i 1))
+    (iota 0 20))"
+
+# Compares the interpreter with a binary built by --compile-c on the first 200 generations of
+# examples/life.lisp, which runs forever.
+dir=$(mktemp -d)
+./minilisp --compile-c examples/life.lisp > $dir/life.c && cc -O2 -I. $dir/life.c -lpthread -o $dir/life
+for mode in interpreted compiled; do
+  cmd=./minilisp
+  [ $mode = compiled ] && cmd=$dir/life
+  start=$(date +%s%N)
+  $cmd < examples/life.lisp | head -n 2200 > /dev/null
+  end=$(date +%s%N)
+  echo "life $mode: $(( (end - start) / 1000000 )) ms"
+done
+rm -rf $dir
+
+# Compares a macro that builds its expansion with list with the same macro written with quasiquote.
+for mode in list quasiquote; do
+  template="(list 'if (list '< a b) (list '+ a 1) (list '- b 1))"
+  [ $mode = quasiquote ] && template='`(if (< ,a ,b) (+ ,a 1) (- ,b 1))'
+  bench "expand-$mode" "
+    (defun list (x . y) (cons x y))
+    (defmacro m (a b) $template)
+    (defun run (n) (dotimes (i n) (macroexpand (m x y))))
+    (run 200000)"
+done
+
+# Compares the latency of running a short script after a prelude in a new process with sending it to
+# a server that has evaluated the prelude already. Both include starting a process, for the client
+# in the latter case.
+dir=$(mktemp -d)
+cat > $dir/prelude.lisp <<'EOF'
+(defun iota (m n) (if (< m n) (cons m (iota (+ m 1) n)) ()))
+(define table (iota 0 500))
+(define total 0)
+(dotimes (i 200000) (setq total (+ total i)))
+EOF
+script="(car (cdr table))"
+./minilisp --serve $dir/sock --prelude $dir/prelude.lisp &
+server=$!
+for i in $(seq 50); do [ -S $dir/sock ] && break; sleep 0.1; done
+for mode in process serve; do
+  start=$(date +%s%N)
+  for i in $(seq 100); do
+    if [ $mode = serve ]; then
+      echo "$script" | ./minilisp --connect $dir/sock > /dev/null
+    else
+      (cat $dir/prelude.lisp; echo "$script") | ./minilisp > /dev/null
+    fi
+  done
+  end=$(date +%s%N)
+  echo "request $mode: $(( (end - start) / 100000 )) us per request"
+done
+kill $server
+rm -rf $dir
+
+# Compares the special forms progn, let, cond, and, or and dotimes with the same forms defined as
+# macros on top of lambda, if and while, in the interpreter and in the JIT compiler.
+forms="
+  (defun classify (i) (cond ((< i 10) 'small) ((< i 100) 'medium) (t 'large)))
+  (defun count (n)
+    (let ((s 0) (m 0))
+      (dotimes (i n s)
+        (let ((c (classify i)))
+          (cond ((or (eq c 'small) (eq c 'medium)) (setq s (+ s 1)))
+                ((and (eq c 'large) (< m i)) (progn (setq m i) (setq s (+ s 2)))))))))
+  (dotimes (k 1000 ()) (count 1000))
+  (println (count 1000))"
+macros="
+  (defun list (x . y) (cons x y))
+  (defun map (f l) (if l (cons (f (car l)) (map f (cdr l))) ()))
+  (defun append (a b) (if a (cons (car a) (append (cdr a) b)) b))
+  (defmacro progn (expr . rest) (list (cons 'lambda (cons () (cons expr rest)))))
+  (defmacro let (bindings . body)
+    (cons (cons 'lambda (cons (map car bindings) body))
+          (map (lambda (b) (car (cdr b))) bindings)))
+  (defmacro and (expr . rest) (if rest (list 'if expr (cons 'and rest)) expr))
+  (defmacro or (expr . rest)
+    (if rest
+        ((lambda (g) (list (list 'lambda (list g) (list 'if g g (cons 'or rest))) expr)) (gensym))
+      expr))
+  (defmacro cond (clause . rest)
+    (list 'if (car clause) (cons 'progn (cdr clause)) (if rest (cons 'cond rest))))
+  (defmacro dotimes (spec . body)
+    ((lambda (var n)
+       (list (list 'lambda (list var n)
+                   (cons 'while (cons (list '< var n)
+                                      (append body (list (list 'setq var (list '+ var 1))))))
+                   (car (cdr (cdr spec))))
+             0 (car (cdr spec))))
+     (car spec) (gensym)))"
+for jit in "" 1; do
+  for mode in native macros; do
+    prog="$forms"
+    [ $mode = macros ] && prog="$macros$forms"
+    start=$(date +%s%N)
+    echo "$prog" | env ${jit:+MINILISP_JIT=$jit} ./minilisp > /dev/null
+    end=$(date +%s%N)
+    echo "forms $mode${jit:+ (jit)}: $(( (end - start) / 1000000 )) ms"
+  done
+done
@@ -2,6 +2,11 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -10,10 +15,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// All interpreter state that is touched while evaluating is thread-local, so that each thread can
+// run its own interpreter with its own heap and symbol table. See the batch mode at the end of
+// this file.
+#define THREAD_LOCAL __thread
+
+// If the error handler is set, error() does not terminate the program but jumps back to it with
+// the message in error_msg. This lets the batch mode report a failed script and move on.
+static THREAD_LOCAL jmp_buf *error_handler;
+static THREAD_LOCAL char error_msg[256];
 
 static __attribute((noreturn)) void error(char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
+  if (error_handler) {
+    vsnprintf(error_msg, sizeof(error_msg), fmt, ap);
+    va_end(ap);
+    longjmp(*error_handler, 1);
+  }
   vfprintf(stderr, fmt, ap);
   fprintf(stderr, "\n");
   va_end(ap);
@@ -33,7 +60,6 @@ enum {
   TPRIMITIVE,
   TFUNCTION,
   TMACRO,
-  TENV,
   // The marker that indicates the object has been moved to other location by GC. The new location
   // can be found at the forwarding pointer. Only the functions to do garbage collection set and
   // handle the object of this type. Other functions will never see the object of this type.
@@ -47,13 +73,27 @@ enum {
 
 // Typedef for the primitive function
 struct Obj;
-typedef struct Obj *Primitive(void *root, struct Obj **env, struct Obj **args);
+typedef struct Obj *Primitive(struct Obj **env, struct Obj **args);
 
 // The object type
+//
+// Cells are the most common objects by far, so they are stored without a header, as just the two
+// words for car and cdr. All other objects begin with a one-word header. To tell them apart, the
+// objects with a header are aligned to 16 bytes, and a pointer to a cell points one word before
+// the cell. Such a pointer is an odd multiple of 8, and the car and cdr members can be accessed as
+// usual. See type_of().
 typedef struct Obj {
   // The first word of the object represents the type of the object. Any code that handles object
-  // needs to check its type first, then access the following union members.
-  int type;
+  // needs to check its type first with type_of(), then access the following union members. The
+  // fields up to the size are not present in cells.
+  uint8_t type;
+
+  // For a function, the NOESCAPE flags telling whether its frames can be on the root stack. See
+  // apply_func().
+  uint8_t noescape;
+
+  // The index of the function in the JIT compiler's table, or 0. See jit_compile().
+  uint16_t jit;
 
   // The total size of the object, including "type" field, this field, the contents, and the
   // padding at the end of the object.
@@ -72,14 +112,17 @@ typedef struct Obj {
     char name[1];
     // Primitive
     Primitive *fn;
-    // Function or Macro
+    // Function or Macro. opt is the optimized body, valid if epoch is current. See
+    // optimized_body().
     struct {
       struct Obj *params;
       struct Obj *body;
       struct Obj *env;
+      struct Obj *opt;
+      int epoch;
     };
     // Environment frame. This is a linked list of association lists
-    // containing the mapping from symbols to their value.
+    // containing the mapping from symbols to their value. Environment frames are cells.
     struct {
       struct Obj *vars;
       struct Obj *up;
@@ -89,17 +132,45 @@ typedef struct Obj {
   };
 } Obj;
 
-// Constants
-// ?? what is &(Obj) { XXX } ???
-// see https://teratail.com/questions/92502
-static Obj *True = &(Obj){ TTRUE };
-static Obj *Nil = &(Obj){ TNIL };
-static Obj *Dot = &(Obj){ TDOT };
-static Obj *Cparen = &(Obj){ TCPAREN };
+// The size of a cell, and the offset from a pointer to a cell to the cell
+#define CELL_SIZE (sizeof(Obj *) * 2)
+#define CELL_OFFSET offsetof(Obj, car)
+
+// The alignment of the objects other than cells
+#define OBJ_ALIGN 16
+
+static inline bool is_cell(Obj *obj) {
+  return (uintptr_t)obj & CELL_OFFSET;
+}
+
+static inline int type_of(Obj *obj) {
+  return is_cell(obj) ? TCELL : obj->type;
+}
+
+// Returns the address of the first byte of the object.
+static inline uint8_t *obj_start(Obj *obj) {
+  return (uint8_t *)obj + ((uintptr_t)obj & CELL_OFFSET);
+}
+
+// Returns the pointer to the cell at the given address.
+static inline Obj *cell_at(uint8_t *p) {
+  return (Obj *)(p - CELL_OFFSET);
+}
+
+// Constants. They are aligned like the other objects with a header.
+static Obj constants[] __attribute((aligned(OBJ_ALIGN))) = { { TTRUE }, { TNIL }, { TDOT }, { TCPAREN } };
+static Obj *True = &constants[0];
+static Obj *Nil = &constants[1];
+static Obj *Dot = &constants[2];
+static Obj *Cparen = &constants[3];
 
 // The list containing all symbols. Such data structure is traditionally called the "obarray", but I
 // avoid using it as a variable name as this is not an array but a list.
-static Obj *Symbols;
+static THREAD_LOCAL Obj *Symbols;
+
+// The streams the reader reads from and the printer writes to.
+static THREAD_LOCAL FILE *input;
+static THREAD_LOCAL FILE *output;
 
 //======================================================================
 // Memory management
@@ -108,21 +179,85 @@ static Obj *Symbols;
 // The size of the heap in byte
 #define MEMORY_SIZE 65536
 
-// The pointer pointing to the beginning of the current heap
-static void *memory;
+// A heap. Cells are allocated upwards from the beginning and the other objects downwards from the
+// end, so that each kind of objects is packed without gaps and can be visited in order. The heap
+// is full when the two meet.
+typedef struct {
+  uint8_t *start;
+  size_t ncells;  // the number of bytes used by cells
+  size_t nobjs;   // the number of bytes used by the other objects
+} Space;
+
+// The current heap
+static THREAD_LOCAL Space heap;
 
 // The pointer pointing to the beginning of the old heap
-static void *from_space;
+static THREAD_LOCAL void *from_space;
+
+static inline size_t space_used(Space *sp) {
+  return sp->ncells + sp->nobjs;
+}
 
-// The number of bytes allocated from the heap
-static size_t mem_nused = 0;
+static inline bool in_space(Space *sp, Obj *obj) {
+  return (size_t)(obj_start(obj) - sp->start) < MEMORY_SIZE;
+}
 
 // Flags to debug GC
-static bool gc_running = false;
+static THREAD_LOCAL bool gc_running = false;
 static bool debug_gc = false;
 static bool always_gc = false;
 
-static void gc(void *root);
+// The garbage collection algorithms. See the comments of the sections below for the incremental
+// and mark-compact ones.
+enum { GC_COPYING, GC_INCREMENTAL, GC_COMPACT };
+static int gc_mode = GC_COPYING;
+
+// The incremental collector stops doing work for an allocation after this many microseconds.
+static double gc_pause_budget = 100;
+
+// An incremental collection starts when the heap is filled up to gc_trigger bytes. It is set after
+// each collection so that half of the free space is left for the next one.
+#define GC_TRIGGER (MEMORY_SIZE / 2)
+static THREAD_LOCAL size_t gc_trigger = GC_TRIGGER;
+
+// The incremental collector does its work in steps of at least this many bytes scanned, so that
+// the cost of reading the clock is spread over several allocations.
+#define GC_STEP_WORK 4096
+
+// GC statistics, printed at exit if MINILISP_GC_STATS is set.
+static THREAD_LOCAL struct {
+  int count;         // the number of completed collections
+  size_t allocated;  // bytes
+  size_t copied;     // bytes
+  size_t peak_heap;  // the maximum number of bytes mapped for the heap and the GC's tables
+  double pause;      // the total time the program was stopped by GC in microseconds
+  double max_pause;
+} gc_stats;
+
+static void gc(void);
+static void gc_step(size_t size);
+
+// Allocates memory block in the given space without running GC. Returns NULL if there's not
+// enough space.
+static Obj *alloc_in(Space *sp, bool cell, size_t size) {
+  if (MEMORY_SIZE < space_used(sp) + size)
+    return NULL;
+  if (cell) {
+    Obj *obj = cell_at(sp->start + sp->ncells);
+    sp->ncells += size;
+    return obj;
+  }
+  sp->nobjs += size;
+  return (Obj *)(sp->start + MEMORY_SIZE - sp->nobjs);
+}
+
+// Allocates memory block in the heap without running GC. Returns NULL if there's not enough space.
+static Obj *alloc_raw(bool cell, size_t size) {
+  Obj *obj = alloc_in(&heap, cell, size);
+  if (obj)
+    gc_stats.allocated += size;
+  return obj;
+}
 
 // Currently we are using Cheney's copying GC algorithm, with which the available memory is split
 // into two halves and all objects are moved from one half to another every time GC is invoked. That
@@ -135,48 +270,71 @@ static void gc(void *root);
 // pointer is pointing to the Lisp object. GC is aware of the pointers in the stack and updates
 // their contents with the objects' new addresses when GC happens.
 //
-// The following is a macro to reserve the area in the C stack for the pointers. The contents of
-// this area are considered to be GC root.
+// The following macros reserve slots for such pointers on the root stack, a per-thread array
+// separate from the C stack. The slots between the bottom of the stack and root_sp are the GC
+// roots. Pushing slots is a pointer bump, and they are popped automatically when the C variable
+// goes out of scope, using the "cleanup" attribute of GCC and Clang. A longjmp skips the cleanup,
+// so code that catches errors must save root_sp before setjmp and restore it after.
 //
 // Be careful not to bypass the two levels of pointer indirections. If you create a direct pointer
 // to an object, it'll cause a subtle bug. Such code would work in most cases but fails with SEGV if
 // GC happens during the execution of the code. Any code that allocates memory may invoke GC.
 
-#define ROOT_END ((void *)-1) // invalid pointer Q. why this is not NULL???
+// The maximum number of slots. Only the pages actually used are backed by memory.
+#define ROOT_STACK_SIZE (1024 * 1024)
+
+static THREAD_LOCAL Obj **root_stack;
+static THREAD_LOCAL Obj **root_sp;
+static THREAD_LOCAL Obj **root_limit;
+
+static void init_root_stack(void) {
+  root_stack = mmap(NULL, ROOT_STACK_SIZE * sizeof(Obj *), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (root_stack == MAP_FAILED)
+    error("Cannot allocate the root stack");
+  root_sp = root_stack;
+  root_limit = root_stack + ROOT_STACK_SIZE;
+}
+
+static void free_root_stack(void) {
+  munmap(root_stack, ROOT_STACK_SIZE * sizeof(Obj *));
+  root_stack = root_sp = root_limit = NULL;
+}
+
+static inline void pop_roots(Obj ***sp) {
+  root_sp = *sp;
+}
 
-// Note that these functions are called only once at a function.
-// captures a variable that named 'root'. points prev frame maybe.
-// Firstly, variable 'root' points prev root in prev stack frame,
-// At the end of this macro 'root' points current root in current stack frame.
-#define ADD_ROOT(size)                          \
-  void *root_ADD_ROOT_[size + 2];		\
-  root_ADD_ROOT_[0] = root;			\
-  for (int i = 1; i <= size; i++)		\
-    root_ADD_ROOT_[i] = NULL;			\
-  root_ADD_ROOT_[size + 1] = ROOT_END;		\
-  root = root_ADD_ROOT_
+// The slots are cleared so that GC does not follow stale pointers left by earlier frames.
+#define ADD_ROOT(size)                                                  \
+  Obj **root_ADD_ROOT_ __attribute((cleanup(pop_roots))) = root_sp;     \
+  if (root_limit - root_sp < size)                                      \
+    error("Stack overflow");                                            \
+  for (int i = 0; i < size; i++)                                        \
+    root_sp[i] = NULL;                                                  \
+  root_sp += size
 
 #define DEFINE1(var1)                           \
-  ADD_ROOT(1);					\
-  Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1)
+  ADD_ROOT(1);                                  \
+  Obj **var1 = root_ADD_ROOT_
 
 #define DEFINE2(var1, var2)                     \
-  ADD_ROOT(2);					\
-  Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1);	\
-  Obj **var2 = (Obj **)(root_ADD_ROOT_ + 2)
+  ADD_ROOT(2);                                  \
+  Obj **var1 = root_ADD_ROOT_;                  \
+  Obj **var2 = root_ADD_ROOT_ + 1
 
 #define DEFINE3(var1, var2, var3)               \
-  ADD_ROOT(3);					\
-  Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1);	\
-  Obj **var2 = (Obj **)(root_ADD_ROOT_ + 2);	\
-  Obj **var3 = (Obj **)(root_ADD_ROOT_ + 3)
+  ADD_ROOT(3);                                  \
+  Obj **var1 = root_ADD_ROOT_;                  \
+  Obj **var2 = root_ADD_ROOT_ + 1;              \
+  Obj **var3 = root_ADD_ROOT_ + 2
 
 #define DEFINE4(var1, var2, var3, var4)         \
-  ADD_ROOT(4);					\
-  Obj **var1 = (Obj **)(root_ADD_ROOT_ + 1);	\
-  Obj **var2 = (Obj **)(root_ADD_ROOT_ + 2);	\
-  Obj **var3 = (Obj **)(root_ADD_ROOT_ + 3);	\
-  Obj **var4 = (Obj **)(root_ADD_ROOT_ + 4)
+  ADD_ROOT(4);                                  \
+  Obj **var1 = root_ADD_ROOT_;                  \
+  Obj **var2 = root_ADD_ROOT_ + 1;              \
+  Obj **var3 = root_ADD_ROOT_ + 2;              \
+  Obj **var4 = root_ADD_ROOT_ + 3
 
 // Round up the given value to a multiple of size. Size must be a power of 2. It adds size - 1
 // first, then zero-ing the least significant bits to make the result a multiple of size. I know
@@ -187,21 +345,57 @@ static inline size_t roundup(size_t var, size_t size) {
   return (var+size-1)/size *size;
 }
 
-// Allocates memory block. This may start GC if we don't have enough memory.
-static Obj *alloc(void *root, int type, size_t size) {
-  // The object must be large enough to contain a pointer for the forwarding pointer. Make it
-  // larger if it's smaller than that. ???
-  // for int, symbol type maybe
-  size = roundup(size, sizeof(void *));
+// Resource limits, so that a runaway script fails with an error rather than running forever or
+// until the heap is exhausted. Exceeding a limit calls error(), so the batch and server modes
+// report it like any other error and go on. They are set by MINILISP_FUEL (the number of function
+// and macro calls and loop iterations, which is enough to bound any evaluation),
+// MINILISP_MAX_DEPTH (the number of nested function calls) and MINILISP_ALLOC_QUOTA (the number of
+// bytes allocated). Each script in the batch and server modes starts with the full amount. The
+// workers running a pmap task share what is left to the caller; see pmap().
+static long fuel_limit;
+static int depth_limit = INT_MAX;
+static size_t alloc_quota;
+
+static THREAD_LOCAL long fuel = LONG_MAX;  // what is left
+static THREAD_LOCAL int depth;             // the number of nested function calls
+static THREAD_LOCAL size_t alloc_limit = SIZE_MAX;  // compared with gc_stats.allocated
+
+static void reset_limits(void) {
+  fuel = fuel_limit ? fuel_limit : LONG_MAX;
+  depth = 0;
+  alloc_limit = alloc_quota ? gc_stats.allocated + alloc_quota : SIZE_MAX;
+}
+
+// The number of timer ticks not yet recorded by the sampling profiler, and the functions being
+// called, indexed by depth. See the "Sampling profiler" section. The signal may be delivered to
+// any thread, so sample_pending is only accessed atomically.
+static int sample_pending;
+static THREAD_LOCAL Obj **prof_stack;
+static void take_sample(void);
+
+// Called on each function call and loop iteration, where the program can be stopped safely.
+static inline void safepoint(void) {
+  if (--fuel < 0) {
+    fuel = 0;
+    error("Fuel exhausted");
+  }
+  if (prof_stack && __atomic_load_n(&sample_pending, __ATOMIC_RELAXED))
+    take_sample();
+}
 
-  // Add the size of the type tag and size fields.
-  size += offsetof(Obj, value);
+// Allocates memory block. This may start GC if we don't have enough memory.
+static Obj *alloc(int type, size_t size) {
+  if (alloc_limit <= gc_stats.allocated)
+    error("Allocation quota exceeded");
 
-  // Round up the object size to the nearest alignment boundary, so that the next object will be
-  // allocated at the proper alignment boundary. Currently we align the object at the same
-  // boundary as the pointer.
-  // ??? what is this ??? objects is allocated in heap, so stack alignment is not neccesarry, isn't it???
-  size = roundup(size, sizeof(void *));
+  // Cells are just two words. Other objects need the type tag and size fields in addition. Their
+  // size is rounded up to the alignment boundary, so that the next object will be allocated at
+  // the proper alignment boundary. This also makes them large enough to contain the forwarding
+  // pointer.
+  if (type == TCELL)
+    size = CELL_SIZE;
+  else
+    size = roundup(size + offsetof(Obj, value), OBJ_ALIGN);
 
   // If the debug flag is on, allocate a new memory space to force all the existing objects to
   // move to new addresses, to invalidate the old addresses. By doing this the GC behavior becomes
@@ -209,23 +403,30 @@ static Obj *alloc(void *root, int type, size_t size) {
   // reference to a Lisp object, the pointer will become invalid by this GC call. Dereferencing
   // that will immediately cause SEGV.
   if (always_gc && !gc_running)
-    gc(root);
+    gc();
+
+  // The incremental collector does a bit of its work on every allocation.
+  if (gc_mode == GC_INCREMENTAL && !always_gc)
+    gc_step(size);
 
   // Otherwise, run GC only when the available memory is not large enough.
-  if (!always_gc && MEMORY_SIZE < mem_nused + size)
-    gc(root);
+  if (!always_gc && MEMORY_SIZE < space_used(&heap) + size)
+    gc();
 
   // Terminate the program if we couldn't satisfy the memory request. This can happen if the
   // requested size was too large or the from-space was filled with too many live objects.
   // one of the gc Memory exhausted situation. From space is full, and all object is live objects.
-  if (MEMORY_SIZE < mem_nused + size)
+  Obj *obj = alloc_raw(type == TCELL, size);
+  if (!obj)
     error("Memory exhausted");
 
-  // Allocate the object.
-  Obj *obj = memory + mem_nused;
-  obj->type = type;
-  obj->size = size;
-  mem_nused += size;
+  // Allocate the object. Cells have no header to fill in.
+  if (type != TCELL) {
+    obj->type = type;
+    obj->noescape = 0;
+    obj->jit = 0;
+    obj->size = size;
+  }
   return obj;
 }
 
@@ -233,113 +434,616 @@ static Obj *alloc(void *root, int type, size_t size) {
 // Garbage collector
 //======================================================================
 
-// Cheney's algorithm uses two pointers to keep track of GC status. At first both pointers point to
-// the beginning of the to-space. As GC progresses, they are moved towards the end of the
-// to-space. The objects before "scan1" are the objects that are fully copied. The objects between
-// "scan1" and "scan2" have already been copied, but may contain pointers to the from-space. "scan2"
-// points to the beginning of the free space.
-static Obj *scan1; // scanned pointer
-static Obj *scan2; // unscanned pointer
+// Cheney's algorithm uses two pointers to keep track of GC status: the objects copied to the
+// to-space but not scanned yet are the objects between the two. We have two kinds of objects,
+// however. The cells are copied to the beginning of the to-space in order, so the cells after
+// "scan_cells" are the ones not scanned yet. The other objects are allocated downwards, so they
+// are pushed to a stack instead when copied. The mark-compact collector uses the same stack to
+// keep the objects marked but not scanned yet.
+static THREAD_LOCAL uint8_t *scan_cells;
+static THREAD_LOCAL Obj **gc_stack;
+static THREAD_LOCAL int gc_sp;
+static THREAD_LOCAL int gc_stack_cap;
+
+static void gc_push(Obj *obj) {
+  if (gc_sp == gc_stack_cap) {
+    gc_stack_cap = gc_stack_cap ? gc_stack_cap * 2 : 256;
+    gc_stack = realloc(gc_stack, sizeof(Obj *) * gc_stack_cap);
+  }
+  gc_stack[gc_sp++] = obj;
+}
+
+// The heaps of other threads that may contain pointers to objects in this heap. Objects in these
+// areas are not managed by this thread's GC, but are scanned as roots. See pmap().
+#define MAX_ROOT_AREAS 64
+static THREAD_LOCAL Space root_areas[MAX_ROOT_AREAS];
+static THREAD_LOCAL int nroot_areas;
+
+static inline size_t obj_size(Obj *obj) {
+  return is_cell(obj) ? CELL_SIZE : obj->size;
+}
+
+static inline void copy_obj(Obj *dst, Obj *src) {
+  if (is_cell(src)) {
+    dst->car = src->car;
+    dst->cdr = src->cdr;
+  } else {
+    memcpy(dst, src, src->size);
+  }
+}
+
+// The marker that indicates the object has been moved. Other objects get TMOVED as the type, but
+// cells have no type field. The car of a moved cell is the new address with the least significant
+// bit set, as no real pointer is odd.
+static inline bool is_moved(Obj *obj) {
+  return is_cell(obj) ? (uintptr_t)obj->car & 1 : obj->type == TMOVED;
+}
+
+static inline Obj *moved_to(Obj *obj) {
+  return is_cell(obj) ? (Obj *)((uintptr_t)obj->car & ~(uintptr_t)1) : obj->moved;
+}
+
+static inline void set_moved(Obj *obj, Obj *newloc) {
+  if (is_cell(obj)) {
+    obj->car = (Obj *)((uintptr_t)newloc | 1);
+  } else {
+    obj->type = TMOVED;
+    obj->moved = newloc;
+  }
+}
+
+// Copies an object to the given space, and remembers it to be scanned later.
+static inline Obj *copy_to(Space *sp, Obj *obj) {
+  Obj *newloc = alloc_in(sp, is_cell(obj), obj_size(obj));
+  if (!newloc)
+    error("Memory exhausted");
+  copy_obj(newloc, obj);
+  if (!is_cell(obj))
+    gc_push(newloc);
+  return newloc;
+}
 
 // Moves one object from the from-space to the to-space. Returns the object's new address. If the
 // object has already been moved, does nothing but just returns the new address.
 static inline Obj *forward(Obj *obj) {
   // If the object's address is not in the from-space, the object is not managed by GC nor it
   // has already been moved to the to-space.
-  ptrdiff_t offset = (uint8_t *)obj - (uint8_t *)from_space;
+  ptrdiff_t offset = obj_start(obj) - (uint8_t *)from_space;
   if (offset < 0 || MEMORY_SIZE <= offset)
     return obj;
 
   // The pointer is pointing to the from-space, but the object there was a tombstone. Follow the
   // forwarding pointer to find the new location of the object.
-  if (obj->type == TMOVED)
-    return obj->moved;
-
-  // Otherwise, the object has not been moved yet. Move it.
-  Obj *newloc = scan2;
-  memcpy(newloc, obj, obj->size);
-  scan2 = (Obj *)((uint8_t *)scan2 + obj->size);
-
-  // Put a tombstone at the location where the object used to occupy, so that the following call
-  // of forward() can find the object's new location.
-  obj->type = TMOVED;
-  obj->moved = newloc;
+  if (is_moved(obj))
+    return moved_to(obj);
+
+  // Otherwise, the object has not been moved yet. Move it, and put a tombstone at the location
+  // where the object used to occupy, so that the following call of forward() can find the
+  // object's new location.
+  Obj *newloc = copy_to(&heap, obj);
+  set_moved(obj, newloc);
   return newloc;
 }
 
+// Replaces each pointer field of the given object with the return value of fn applied to it.
+static inline void scan_fields(Obj *obj, Obj *(*fn)(Obj *)) {
+  switch (type_of(obj)) {
+  case TINT:
+  case TSYMBOL:
+  case TPRIMITIVE:
+    // Any of the above types does not contain a pointer to a GC-managed object.
+    break;
+  case TCELL:
+    obj->car = fn(obj->car);
+    obj->cdr = fn(obj->cdr);
+    break;
+  case TFUNCTION:
+  case TMACRO:
+    obj->params = fn(obj->params);
+    obj->body = fn(obj->body);
+    obj->env = fn(obj->env);
+    obj->opt = fn(obj->opt);
+    break;
+  default:
+    error("Bug: copy: unknown type %d", type_of(obj));
+  }
+}
+
+// Scans one object that has been copied to the space but not scanned yet. Returns its size, or 0
+// if there's no such object.
+static inline size_t scan_next(Space *sp, Obj *(*fn)(Obj *)) {
+  if (scan_cells < sp->start + sp->ncells) {
+    Obj *cell = cell_at(scan_cells);
+    scan_cells += CELL_SIZE;
+    scan_fields(cell, fn);
+    return CELL_SIZE;
+  }
+  if (gc_sp) {
+    Obj *obj = gc_stack[--gc_sp];
+    scan_fields(obj, fn);
+    return obj->size;
+  }
+  return 0;
+}
+
+// Applies scan_fields() to every object in the space.
+static void scan_space(Space *sp, Obj *(*fn)(Obj *)) {
+  for (uint8_t *p = sp->start; p < sp->start + sp->ncells; p += CELL_SIZE)
+    scan_fields(cell_at(p), fn);
+  uint8_t *end = sp->start + MEMORY_SIZE;
+  for (uint8_t *p = end - sp->nobjs; p < end; p += ((Obj *)p)->size)
+    scan_fields((Obj *)p, fn);
+}
+
+// The number of bytes currently mapped for the heap and the GC's tables
+static THREAD_LOCAL size_t heap_mapped;
+
+static void add_heap_mapped(ptrdiff_t size) {
+  heap_mapped += size;
+  if (gc_stats.peak_heap < heap_mapped)
+    gc_stats.peak_heap = heap_mapped;
+}
+
 // see https://linuxjm.osdn.jp/html/LDP_man-pages/man2/mmap.2.html
 static void *alloc_semispace() {
+  add_heap_mapped(MEMORY_SIZE);
   return mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
 }
 
+static void free_semispace(void *p) {
+  add_heap_mapped(-MEMORY_SIZE);
+  munmap(p, MEMORY_SIZE);
+}
+
+static void init_compact_tables(void);
+
+// Gives the current thread an empty heap.
+static void init_heap(void) {
+  heap = (Space){ alloc_semispace(), 0, 0 };
+  if (gc_mode == GC_COMPACT)
+    init_compact_tables();
+}
+
+static void forward_jit_roots(Obj *(*fn)(Obj *));
+static void forward_prof_roots(Obj *(*fn)(Obj *));
+
+// Copies the root objects other than the ones on the root stack.
+static void forward_global_roots(Obj *(*fn)(Obj *)) {
+  Symbols = fn(Symbols);
+  for (int i = 0; i < nroot_areas; i++)
+    scan_space(&root_areas[i], fn);
+  forward_jit_roots(fn);
+  forward_prof_roots(fn);
+}
+
 // Copies the root objects.
-// forward move starts from current frame root.
-static void forward_root_objects(void *root) {
-  Symbols = forward(Symbols);
-  // end of frames == NULL. see main().
-  for (void **frame = root; frame; frame = *(void ***)frame) // frame = *(void ***)frame what is this??? maybe go to next frame??? よさそう
-    for (int i = 1; frame[i] != ROOT_END; i++)
-      if (frame[i])
-	frame[i] = forward(frame[i]);
+static void forward_root_objects(Obj *(*fn)(Obj *)) {
+  forward_global_roots(fn);
+  for (Obj **p = root_stack; p < root_sp; p++)
+    if (*p)
+      *p = fn(*p);
+}
+
+static double now_usec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void record_pause(double start) {
+  double t = now_usec() - start;
+  gc_stats.pause += t;
+  if (gc_stats.max_pause < t)
+    gc_stats.max_pause = t;
 }
 
+static void finish_gc_cycle(void);
+static THREAD_LOCAL bool gc_cycle;
+
 // Implements Cheney's copying garbage collection algorithm.
 // http://en.wikipedia.org/wiki/Cheney%27s_algorithm
-static void gc(void *root) {
+static void copying_gc(void) {
   assert(!gc_running);
   gc_running = true;
 
   // Allocate a new semi-space.
-  from_space = memory;
-  memory = alloc_semispace();
+  size_t old_nused = space_used(&heap);
+  from_space = heap.start;
+  heap = (Space){ alloc_semispace(), 0, 0 };
+  scan_cells = heap.start;
 
-  // Initialize the two pointers for GC. Initially they point to the beginning of the to-space.
-  scan1 = scan2 = memory;
+  // Copy the GC root objects first.
+  forward_root_objects(forward);
 
-  // Copy the GC root objects first. This moves the pointer scan2.
-  forward_root_objects(root);
-
-  // Copy the objects referenced by the GC root objects located between scan1 and scan2. Once it's
-  // finished, all live objects (i.e. objects reachable from the root) will have been copied to
-  // the to-space.
-  // breath first search
+  // Copy the objects referenced by the copied objects until there's nothing left to scan. Once
+  // it's finished, all live objects (i.e. objects reachable from the root) will have been copied
+  // to the to-space.
   // ref: https://seesaawiki.jp/w/author_nari/d/GC/standard/Copying
-  while (scan1 < scan2) {
-    // "o の子オブジェクト達のうち、未コピーであるものをアドレスunscanned にコピーする(o の子オブジェクト達を灰色にする)。"
-    // "同時に、o 中のポインタがコピー先をさすように書き換え、scanned を進める(o を黒にする)。"
-    switch (scan1->type) {
-    case TINT:
-    case TSYMBOL:
-    case TPRIMITIVE:
-      // Any of the above types does not contain a pointer to a GC-managed object.
-      break;
-    case TCELL:
-      scan1->car = forward(scan1->car);
-      scan1->cdr = forward(scan1->cdr);
-      break;
-    case TFUNCTION:
-    case TMACRO:
-      scan1->params = forward(scan1->params);
-      scan1->body = forward(scan1->body);
-      scan1->env = forward(scan1->env);
+  while (scan_next(&heap, forward))
+    ;
+
+  // Finish up GC.
+  free_semispace(from_space);
+  if (debug_gc)
+    fprintf(stderr, "GC: %zu bytes out of %zu bytes copied.\n", space_used(&heap), old_nused);
+  gc_stats.count++;
+  gc_stats.copied += space_used(&heap);
+  gc_running = false;
+}
+
+static void mark_compact_gc(void);
+
+static void gc(void) {
+  double start = now_usec();
+  // If an incremental collection is in progress, finishing it does the same thing.
+  if (gc_cycle)
+    finish_gc_cycle();
+  else if (gc_mode == GC_COMPACT)
+    mark_compact_gc();
+  else
+    copying_gc();
+  record_pause(start);
+}
+
+// Packs all live objects without gaps between them, whichever collector is in use.
+static void compact_heap(void) {
+  if (gc_cycle)
+    finish_gc_cycle();
+  else if (gc_mode == GC_COMPACT)
+    mark_compact_gc();
+  else
+    copying_gc();
+}
+
+//======================================================================
+// Incremental garbage collector
+//
+// Cheney's algorithm stops the program for time proportional to the number of live objects. The
+// incremental mode (MINILISP_GC=incremental) spreads the same work over allocations instead, so
+// that each pause is bounded by gc_pause_budget.
+//
+// It is a replicating collector. The program keeps using the objects in the from-space, and keeps
+// allocating new ones there, while the collector copies the reachable objects to the to-space a few
+// at a time. Because the originals must stay intact, the from-space does not get tombstones; the
+// address of each object's replica is recorded in a side table instead. The program never sees a
+// replica until the collection finishes, so no read barrier is needed. However, an object that
+// has already been copied may be modified afterwards. Such objects are recorded by the write
+// barrier, and their replicas are copied again.
+//
+// Each step does a bounded amount of work: it scans objects in the to-space, copies modified
+// objects again, or copies the objects a slice of the root stack points to. The roots are visited
+// in passes; the first seeds the collection, and the last starts when nothing else is left to do.
+// When the last pass ends with nothing left either, the collection finishes: the roots are
+// forwarded to the replicas, whatever has changed during the last pass is copied, and the
+// to-space becomes the heap. That final pause is proportional to what the program did during the
+// last pass, not to the number of live objects. If the from-space becomes full first, the whole
+// remaining work is done at once.
+//======================================================================
+
+// The new heap while an incremental collection is in progress
+static THREAD_LOCAL Space to_space;
+
+// The replica of each from-space object, indexed by the object's offset divided by the pointer
+// size. The least significant bit is set if the object has been modified after it was copied.
+static THREAD_LOCAL Obj **replicas;
+
+// The objects modified after they were copied
+static THREAD_LOCAL Obj **dirty;
+static THREAD_LOCAL int ndirty;
+static THREAD_LOCAL int dirty_cap;
+
+// The number of bytes to scan per byte allocated. It's chosen so that the collection finishes
+// before the from-space becomes full.
+static THREAD_LOCAL size_t gc_work_ratio;
+
+// The work owed by the allocations since the last step, in bytes
+static THREAD_LOCAL size_t gc_debt;
+
+// The next root stack slot to visit in the current pass over the roots, and the number of passes
+// finished in this collection
+static THREAD_LOCAL size_t root_pass_pos;
+static THREAD_LOCAL int root_passes;
+
+// The number of root stack slots visited by a step at a time
+#define ROOT_SLICE 64
+
+static inline Obj **replica_slot(Obj *obj) {
+  ptrdiff_t offset = obj_start(obj) - (uint8_t *)from_space;
+  if (offset < 0 || MEMORY_SIZE <= offset)
+    return NULL;
+  return &replicas[offset / sizeof(void *)];
+}
+
+// Copies an object to the to-space unless it has already been copied. Returns the replica.
+static inline Obj *replicate(Obj *obj) {
+  Obj **slot = replica_slot(obj);
+  if (!slot)
+    return obj;
+  if (*slot)
+    return (Obj *)((uintptr_t)*slot & ~(uintptr_t)1);
+  Obj *newloc = copy_to(&to_space, obj);
+  *slot = newloc;
+  return newloc;
+}
+
+// Copies an object like replicate() but returns the original, so that the program keeps using it.
+static Obj *shade(Obj *obj) {
+  replicate(obj);
+  return obj;
+}
+
+// Must be called before modifying a field of an object.
+static inline void write_barrier(Obj *obj) {
+  if (!gc_cycle)
+    return;
+  Obj **slot = replica_slot(obj);
+  if (!slot || !*slot || ((uintptr_t)*slot & 1))
+    return;
+  *slot = (Obj *)((uintptr_t)*slot | 1);
+  if (ndirty == dirty_cap) {
+    dirty_cap = dirty_cap ? dirty_cap * 2 : 256;
+    dirty = realloc(dirty, sizeof(Obj *) * dirty_cap);
+  }
+  dirty[ndirty++] = obj;
+}
+
+static void start_gc_cycle(void) {
+  if (!replicas)
+    replicas = malloc(MEMORY_SIZE / sizeof(void *) * sizeof(Obj *));
+  memset(replicas, 0, MEMORY_SIZE / sizeof(void *) * sizeof(Obj *));
+  from_space = heap.start;
+  to_space = (Space){ alloc_semispace(), 0, 0 };
+  scan_cells = to_space.start;
+  // We don't know how much of the heap is alive yet, so assume the worst. The two passes over the
+  // root stack are work too.
+  size_t nused = space_used(&heap);
+  size_t nfree = MEMORY_SIZE - nused;
+  size_t work = nused + 2 * (root_sp - root_stack) * sizeof(Obj *);
+  gc_work_ratio = nfree ? work / nfree + 1 : MEMORY_SIZE;
+  gc_debt = 0;
+  root_pass_pos = 0;
+  root_passes = 0;
+  gc_cycle = true;
+}
+
+static void finish_gc_cycle(void) {
+  gc_running = true;
+  forward_root_objects(replicate);
+  for (int i = 0; i < ndirty; i++) {
+    Obj *obj = dirty[i];
+    Obj *newloc = replicate(obj);
+    copy_obj(newloc, obj);
+    scan_fields(newloc, replicate);
+  }
+  while (scan_next(&to_space, replicate))
+    ;
+
+  free_semispace(from_space);
+  size_t old_nused = space_used(&heap);
+  heap = to_space;
+  if (debug_gc)
+    fprintf(stderr, "GC: %zu bytes out of %zu bytes copied, %d modified.\n", space_used(&heap),
+            old_nused, ndirty);
+  ndirty = 0;
+  gc_cycle = false;
+  gc_stats.count++;
+  gc_stats.copied += space_used(&heap);
+  gc_running = false;
+  gc_trigger = space_used(&heap) + (MEMORY_SIZE - space_used(&heap)) / 2;
+}
+
+// Abandons the collection in progress, if any. Used when the heap is about to be discarded.
+static void abort_gc_cycle(void) {
+  gc_sp = 0;
+  if (!gc_cycle)
+    return;
+  free_semispace(to_space.start);
+  ndirty = 0;
+  gc_cycle = false;
+}
+
+// Does a piece of the work of the collection in progress. Returns the number of bytes of work
+// done, or 0 if only the final pause is left.
+static size_t gc_work(void) {
+  size_t n = scan_next(&to_space, replicate);
+  if (n)
+    return n;
+
+  // Copy a modified object again. It is recorded again if it's modified after this.
+  if (ndirty) {
+    Obj *obj = dirty[--ndirty];
+    Obj **slot = replica_slot(obj);
+    Obj *newloc = (Obj *)((uintptr_t)*slot & ~(uintptr_t)1);
+    *slot = newloc;
+    copy_obj(newloc, obj);
+    scan_fields(newloc, replicate);
+    return obj_size(obj);
+  }
+
+  // Visit the next slice of the roots.
+  size_t nroots = root_sp - root_stack;
+  if (root_pass_pos == 0)
+    forward_global_roots(shade);
+  size_t end = root_pass_pos + ROOT_SLICE < nroots ? root_pass_pos + ROOT_SLICE : nroots;
+  for (; root_pass_pos < end; root_pass_pos++)
+    if (root_stack[root_pass_pos])
+      replicate(root_stack[root_pass_pos]);
+  if (root_pass_pos < nroots)
+    return ROOT_SLICE * sizeof(Obj *);
+  root_pass_pos = 0;
+  if (++root_passes < 2)
+    return ROOT_SLICE * sizeof(Obj *);
+  return 0;
+}
+
+// Called on every allocation of the given size in the incremental mode. Starts a collection, or
+// does the amount of work proportional to the size, once enough work is owed to make a step,
+// until the pause budget runs out.
+static void gc_step(size_t size) {
+  if (!gc_cycle) {
+    if (gc_trigger < space_used(&heap) + size) {
+      double start = now_usec();
+      start_gc_cycle();
+      record_pause(start);
+    }
+    return;
+  }
+  gc_debt += size * gc_work_ratio;
+  if (gc_debt < GC_STEP_WORK)
+    return;
+  double start = now_usec();
+  for (int n = 1; 0 < gc_debt; n++) {
+    size_t work = gc_work();
+    if (!work) {
+      finish_gc_cycle();
       break;
-    case TENV:
-      scan1->vars = forward(scan1->vars);
-      scan1->up = forward(scan1->up);
+    }
+    gc_debt = work < gc_debt ? gc_debt - work : 0;
+    if (n % 16 == 0 && gc_pause_budget <= now_usec() - start)
       break;
-    default:
-      error("Bug: copy: unknown type %d", scan1->type);
+  }
+  // The work left over is owed by the next step, up to what a whole collection would take.
+  if (MEMORY_SIZE < gc_debt)
+    gc_debt = MEMORY_SIZE;
+  record_pause(start);
+}
+
+//======================================================================
+// Mark-compact garbage collector
+//
+// A copying collector needs twice as much memory as the live objects while it runs. The
+// mark-compact collector (MINILISP_GC=compact) slides the live objects towards the ends of the
+// heap in place instead, so the heap is a single space of the same size. As with the copying
+// collector, the objects are always packed without gaps and allocated by bumping a pointer.
+//
+// GC marks the objects reachable from the roots, using the same pointer visitor as the copying
+// collector. A live cell's new address is the total size of the live cells before it, and the new
+// address of another object is computed the same way from the end of the heap. To find it quickly
+// without storing a forwarding pointer in each object, the mark bitmap has one bit for every word
+// occupied by a live object, and the live bytes before each 64-word block are precomputed. The
+// number of live bytes before an object is then that number plus the number of bits set before
+// the object in its block. This is the idea of the Compressor collector. The collector then
+// updates all pointers, and finally moves the objects.
+//======================================================================
+
+#define BLOCK_WORDS 64
+#define NBLOCKS (MEMORY_SIZE / sizeof(void *) / BLOCK_WORDS)
+
+// One bit for each word of the heap, set if the word belongs to a live object. One word per block.
+static THREAD_LOCAL uint64_t *mark_bits;
+
+// The number of live bytes before each block
+static THREAD_LOCAL uint32_t *block_offsets;
+
+// The number of live bytes of each kind
+static THREAD_LOCAL size_t live_cells;
+static THREAD_LOCAL size_t live_objs;
+
+static void init_compact_tables(void) {
+  if (mark_bits)
+    return;
+  mark_bits = malloc(NBLOCKS * sizeof(uint64_t));
+  block_offsets = malloc(NBLOCKS * sizeof(uint32_t));
+  add_heap_mapped(NBLOCKS * (sizeof(uint64_t) + sizeof(uint32_t)));
+}
+
+static inline size_t word_index(uint8_t *p) {
+  return (p - heap.start) / sizeof(void *);
+}
+
+static inline bool is_marked(size_t word) {
+  return mark_bits[word / BLOCK_WORDS] & (1ULL << (word % BLOCK_WORDS));
+}
+
+static Obj *mark(Obj *obj) {
+  if (!in_space(&heap, obj))
+    return obj;
+  size_t word = word_index(obj_start(obj));
+  if (is_marked(word))
+    return obj;
+  size_t size = obj_size(obj);
+  for (size_t i = word; i < word + size / sizeof(void *); i++)
+    mark_bits[i / BLOCK_WORDS] |= 1ULL << (i % BLOCK_WORDS);
+  if (is_cell(obj))
+    live_cells += size;
+  else
+    live_objs += size;
+  gc_push(obj);
+  return obj;
+}
+
+// Returns the address the object will be moved to.
+static Obj *new_address(Obj *obj) {
+  if (!in_space(&heap, obj))
+    return obj;
+  size_t word = word_index(obj_start(obj));
+  uint64_t before = mark_bits[word / BLOCK_WORDS] & ((1ULL << (word % BLOCK_WORDS)) - 1);
+  size_t live = block_offsets[word / BLOCK_WORDS] + __builtin_popcountll(before) * sizeof(void *);
+  if (is_cell(obj))
+    return cell_at(heap.start + live);
+  // All live cells are before the object.
+  return (Obj *)(heap.start + MEMORY_SIZE - live_objs + (live - live_cells));
+}
+
+static void mark_compact_gc(void) {
+  assert(!gc_running);
+  gc_running = true;
+
+  // Mark
+  memset(mark_bits, 0, NBLOCKS * sizeof(uint64_t));
+  live_cells = live_objs = 0;
+  forward_root_objects(mark);
+  while (gc_sp)
+    scan_fields(gc_stack[--gc_sp], mark);
+
+  // Compute the new addresses
+  size_t live = 0;
+  for (int i = 0; i < NBLOCKS; i++) {
+    block_offsets[i] = live;
+    live += __builtin_popcountll(mark_bits[i]) * sizeof(void *);
+  }
+
+  // Update the pointers. The live objects other than cells are pushed to the stack to be moved.
+  forward_root_objects(new_address);
+  uint8_t *cells_end = heap.start + heap.ncells;
+  for (uint8_t *p = heap.start; p < cells_end; p += CELL_SIZE)
+    if (is_marked(word_index(p)))
+      scan_fields(cell_at(p), new_address);
+  uint8_t *end = heap.start + MEMORY_SIZE;
+  for (uint8_t *p = end - heap.nobjs; p < end; p += ((Obj *)p)->size) {
+    if (is_marked(word_index(p))) {
+      scan_fields((Obj *)p, new_address);
+      gc_push((Obj *)p);
     }
-    //"scanned を進める(o を黒にする)"
-    scan1 = (Obj *)((uint8_t *)scan1 + scan1->size);
   }
 
-  // Finish up GC.
-  munmap(from_space, MEMORY_SIZE);
-  size_t old_nused = mem_nused;
-  mem_nused = (size_t)((uint8_t *)scan1 - (uint8_t *)memory);
+  // Move the objects. A cell never moves to a higher address, and the other objects never move to
+  // a lower address, so the objects that have not been moved yet are never overwritten if the
+  // cells are moved in ascending order and the others in descending order.
+  for (uint8_t *p = heap.start; p < cells_end; p += CELL_SIZE) {
+    if (!is_marked(word_index(p)))
+      continue;
+    uint8_t *newloc = obj_start(new_address(cell_at(p)));
+    if (newloc != p) {
+      memmove(newloc, p, CELL_SIZE);
+      gc_stats.copied += CELL_SIZE;
+    }
+  }
+  while (gc_sp) {
+    Obj *obj = gc_stack[--gc_sp];
+    Obj *newloc = new_address(obj);
+    if (newloc != obj) {
+      memmove(newloc, obj, obj->size);
+      gc_stats.copied += obj->size;
+    }
+  }
+
+  size_t old_nused = space_used(&heap);
+  heap.ncells = live_cells;
+  heap.nobjs = live_objs;
   if (debug_gc)
-    fprintf(stderr, "GC: %zu bytes out of %zu bytes copied.\n", mem_nused, old_nused);
+    fprintf(stderr, "GC: %zu bytes out of %zu bytes live.\n", space_used(&heap), old_nused);
+  gc_stats.count++;
   gc_running = false;
 }
 
@@ -347,55 +1051,56 @@ static void gc(void *root) {
 // Constructors
 //======================================================================
 
-static Obj *make_int(void *root, int value) {
-  Obj *r = alloc(root, TINT, sizeof(int));
+static Obj *make_int(int value) {
+  Obj *r = alloc(TINT, sizeof(int));
   r->value = value;
   return r;
 }
 
-static Obj *cons(void *root, Obj **car, Obj **cdr) {
-  Obj *cell = alloc(root, TCELL, sizeof(Obj *) * 2);
+static Obj *cons(Obj **car, Obj **cdr) {
+  Obj *cell = alloc(TCELL, sizeof(Obj *) * 2);
   cell->car = *car;
   cell->cdr = *cdr;
   return cell;
 }
 
-static Obj *make_symbol(void *root, char *name) {
-  Obj *sym = alloc(root, TSYMBOL, strlen(name) + 1);
+static Obj *make_symbol(char *name) {
+  Obj *sym = alloc(TSYMBOL, strlen(name) + 1);
   strcpy(sym->name, name);
   return sym;
 }
 
-static Obj *make_primitive(void *root, Primitive *fn) {
-  Obj *r = alloc(root, TPRIMITIVE, sizeof(Primitive *));
+static Obj *make_primitive(Primitive *fn) {
+  Obj *r = alloc(TPRIMITIVE, sizeof(Primitive *));
   r->fn = fn;
   return r;
 }
 
-static Obj *make_function(void *root, Obj **env, int type, Obj **params, Obj **body) {
+static Obj *make_function(Obj **env, int type, Obj **params, Obj **body) {
   assert(type == TFUNCTION || type == TMACRO);
-  Obj *r = alloc(root, type, sizeof(Obj *) * 3);
+  Obj *r = alloc(type, sizeof(Obj *) * 4 + sizeof(int));
   r->params = *params;
   r->body = *body;
   r->env = *env;
+  r->opt = Nil;
   return r;
 }
 
-struct Obj *make_env(void *root, Obj **vars, Obj **up) {
-  Obj *r = alloc(root, TENV, sizeof(Obj *) * 2);
+struct Obj *make_env(Obj **vars, Obj **up) {
+  Obj *r = alloc(TCELL, sizeof(Obj *) * 2);
   r->vars = *vars;
   r->up = *up;
   return r;
 }
 
 // Returns ((x . y) . a)
-static Obj *acons(void *root, Obj **x, Obj **y, Obj **a) {
+static Obj *acons(Obj **x, Obj **y, Obj **a) {
   // why this uses DEFINE1?
   // this is not nessesary, i think.
   DEFINE1(cell);
   //Obj *cell = alloc(root,TCELL,sizeof(Obj*) * 2); -> this is bad.
-  *cell = cons(root, x, y);
-  return cons(root, cell, a); // this may cause gc, so cell must be a indirect access.
+  *cell = cons(x, y);
+  return cons(cell, a); // this may cause gc, so cell must be a indirect access.
 }
 
 //======================================================================
@@ -407,11 +1112,11 @@ static Obj *acons(void *root, Obj **x, Obj **y, Obj **a) {
 #define SYMBOL_MAX_LEN 200
 const char symbol_chars[] = "~!@#$%^&*-_=+:/?<>";
 
-static Obj *read_expr(void *root);
+static Obj *read_expr(void);
 
 static int peek(void) {
-  int c = getchar();
-  ungetc(c, stdin);
+  int c = getc(input);
+  ungetc(c, input);
   return c;
 }
 
@@ -421,6 +1126,7 @@ static Obj *reverse(Obj *p) {
   while (p != Nil) {
     Obj *head = p;
     p = p->cdr;
+    write_barrier(head);
     head->cdr = ret;
     ret = head;
   }
@@ -430,83 +1136,85 @@ static Obj *reverse(Obj *p) {
 // Skips the input until newline is found. Newline is one of \r, \r\n or \n.
 static void skip_line(void) {
   for (;;) {
-    int c = getchar();
+    int c = getc(input);
     if (c == EOF || c == '\n')
       return;
     if (c == '\r') {
       if (peek() == '\n')
-	getchar();
+	getc(input);
       return;
     }
   }
 }
 
 // Reads a list. Note that '(' has already been read.
-static Obj *read_list(void *root) {
+static Obj *read_list(void) {
   DEFINE3(obj, head, last);
   *head = Nil;
   for (;;) {
-    *obj = read_expr(root);
+    *obj = read_expr();
     if (!*obj)
       error("Unclosed parenthesis");
     if (*obj == Cparen)
       return reverse(*head);
     if (*obj == Dot) {
-      *last = read_expr(root);
-      if (read_expr(root) != Cparen)
+      *last = read_expr();
+      if (read_expr() != Cparen)
 	error("Closed parenthesis expected after dot");
       Obj *ret = reverse(*head);
+      write_barrier(*head);
       (*head)->cdr = *last;
       return ret;
     }
-    *head = cons(root, obj, head);
+    *head = cons(obj, head);
   }
 }
 
 // May create a new symbol. If there's a symbol with the same name, it will not create a new symbol
 // but return the existing one.
-static Obj *intern(void *root, char *name) {
+static Obj *intern(char *name) {
   for (Obj *p = Symbols; p != Nil; p = p->cdr)
     if (strcmp(name, p->car->name) == 0)
       return p->car;
   DEFINE1(sym);
-  *sym = make_symbol(root, name);
-  Symbols = cons(root, sym, &Symbols);
+  *sym = make_symbol(name);
+  Symbols = cons(sym, &Symbols);
   return *sym;
 }
 
-// Reader marcro ' (single quote). It reads an expression and returns (quote <expr>).
-static Obj *read_quote(void *root) {
+// Reader marcros ' (single quote), ` (backquote), "," and ",@". It reads an expression and returns
+// (quote <expr>), (quasiquote <expr>), (unquote <expr>) or (unquote-splicing <expr>).
+static Obj *read_quote(char *name) {
   DEFINE2(sym, tmp);
-  *sym = intern(root, "quote");
-  *tmp = read_expr(root);
-  *tmp = cons(root, tmp, &Nil);
-  *tmp = cons(root, sym, tmp); // if you don't use DEFINE2, here 'sym' can ponts invalid moved objects.
+  *sym = intern(name);
+  *tmp = read_expr();
+  *tmp = cons(tmp, &Nil);
+  *tmp = cons(sym, tmp); // if you don't use DEFINE2, here 'sym' can ponts invalid moved objects.
   return *tmp;
 }
 
 static int read_number(int val) {
   while (isdigit(peek()))
-    val = val * 10 + (getchar() - '0');
+    val = val * 10 + (getc(input) - '0');
   return val;
 }
 
-static Obj *read_symbol(void *root, char c) {
+static Obj *read_symbol(char c) {
   char buf[SYMBOL_MAX_LEN + 1];
   buf[0] = c;
   int len = 1;
   while (isalnum(peek()) || strchr(symbol_chars, peek())) {
     if (SYMBOL_MAX_LEN <= len)
       error("Symbol name too long");
-    buf[len++] = getchar();
+    buf[len++] = getc(input);
   }
   buf[len] = '\0';
-  return intern(root, buf);
+  return intern(buf);
 }
 
-static Obj *read_expr(void *root) {
+static Obj *read_expr(void) {
   for (;;) {
-    int c = getchar();
+    int c = getc(input);
     if (c == ' ' || c == '\n' || c == '\r' || c == '\t')
       continue;
     if (c == EOF)
@@ -516,46 +1224,54 @@ static Obj *read_expr(void *root) {
       continue;
     }
     if (c == '(')
-      return read_list(root);
+      return read_list();
     if (c == ')')
       return Cparen;
     if (c == '.')
       return Dot;
     if (c == '\'')
-      return read_quote(root);
+      return read_quote("quote");
+    if (c == '`')
+      return read_quote("quasiquote");
+    if (c == ',') {
+      if (peek() != '@')
+        return read_quote("unquote");
+      getc(input);
+      return read_quote("unquote-splicing");
+    }
     if (isdigit(c))
-      return make_int(root, read_number(c - '0'));
+      return make_int(read_number(c - '0'));
     if (c == '-' && isdigit(peek()))
-      return make_int(root, -read_number(0));
+      return make_int(-read_number(0));
     if (isalpha(c) || strchr(symbol_chars, c))
-      return read_symbol(root, c);
+      return read_symbol(c);
     error("Don't know how to handle %c", c);
   }
 }
 
 // Prints the given object.
 static void print(Obj *obj) {
-  switch (obj->type) {
+  switch (type_of(obj)) {
   case TCELL:
-    printf("(");
+    fprintf(output, "(");
     for (;;) {
       print(obj->car);
       if (obj->cdr == Nil)
 	break;
-      if (obj->cdr->type != TCELL) {
-	printf(" . ");
+      if (type_of(obj->cdr) != TCELL) {
+	fprintf(output, " . ");
 	print(obj->cdr);
 	break;
       }
-      printf(" ");
+      fprintf(output, " ");
       obj = obj->cdr;
     }
-    printf(")");
+    fprintf(output, ")");
     return;
 
 #define CASE(type, ...)                         \
     case type:                                  \
-      printf(__VA_ARGS__);			\
+      fprintf(output, __VA_ARGS__);		\
       return
     CASE(TINT, "%d", obj->value);
     CASE(TSYMBOL, "%s", obj->name);
@@ -567,14 +1283,14 @@ static void print(Obj *obj) {
     CASE(TNIL, "()");
 #undef CASE
   default:
-    error("Bug: print: Unknown tag type: %d", obj->type);
+    error("Bug: print: Unknown tag type: %d", type_of(obj));
   }
 }
 
 // Returns the length of the given list. -1 if it's not a proper list.
 static int length(Obj *list) {
   int len = 0;
-  for (; list->type == TCELL; list = list->cdr)
+  for (; type_of(list) == TCELL; list = list->cdr)
     len++;
   return list == Nil ? len : -1;
 }
@@ -583,77 +1299,251 @@ static int length(Obj *list) {
 // Evaluator
 //======================================================================
 
-static Obj *eval(void *root, Obj **env, Obj **obj);
+static Obj *eval(Obj **env, Obj **obj);
+
+// The JIT compiler. See its section below.
+typedef Obj *JitCode(Obj **env);
+static THREAD_LOCAL bool jit_thread;
+static int jit_register(Obj *scopes);
+static JitCode *jit_code(Obj **fn, Obj **env);
 
-static void add_variable(void *root, Obj **env, Obj **sym, Obj **val) {
+// The optimizer. See its section below.
+static Obj *optimized_body(Obj **fn);
+static bool creates_closure(Obj *body);
+
+// The flags of a function whose body, or optimized body, creates no closure. As nothing can refer
+// to the environment frame of such a function after it returns, the frame is allocated on the
+// root stack rather than in the heap, and is popped on return.
+#define NOESCAPE_BODY 1
+#define NOESCAPE_OPT 2
+
+// Incremented whenever a variable holding a function, macro or primitive is defined or assigned,
+// which invalidates the optimized function bodies.
+static THREAD_LOCAL int defs_epoch;
+
+static bool is_callable(Obj *obj) {
+  return type_of(obj) == TFUNCTION || type_of(obj) == TMACRO || type_of(obj) == TPRIMITIVE;
+}
+
+static void note_binding(Obj *old, Obj *val) {
+  if (is_callable(old) || is_callable(val))
+    defs_epoch++;
+}
+
+// True if the current thread is a pmap worker. A worker may read the objects in the heap of the
+// thread that called pmap but must not modify them, as that heap is not its own. Its own objects,
+// including the frames on its root stack, are writable.
+static THREAD_LOCAL bool in_pmap_worker;
+
+// The heap of the thread that called pmap, while the workers run its task
+static Space shared_heap;
+
+// True while the optimizer or the JIT compiler expands a macro ahead of time. Such an expansion
+// may run at a different time, and a different number of times, than the form would be evaluated,
+// so it must not change anything the program can see. See expand_early().
+static THREAD_LOCAL bool expanding_early;
+
+static void check_effect(char *name) {
+  if (expanding_early)
+    error("%s: side effect in an early macro expansion", name);
+}
+
+static void check_writable(Obj *obj, char *name) {
+  check_effect(name);
+  if (in_pmap_worker && in_space(&shared_heap, obj))
+    error("%s: cannot modify a shared object in pmap", name);
+}
+
+static void add_variable(Obj **env, Obj **sym, Obj **val) {
   // DEFINE* is used here. Use indirect access.
+  check_writable(*env, "define");
+  // Redefining a variable updates the existing binding, as compiled code may refer to it.
+  for (Obj *cell = (*env)->vars; cell != Nil; cell = cell->cdr) {
+    Obj *bind = cell->car;
+    if (bind->car == *sym) {
+      note_binding(bind->cdr, *val);
+      write_barrier(bind);
+      bind->cdr = *val;
+      return;
+    }
+  }
+  note_binding(Nil, *val);
   DEFINE2(vars, tmp);
   *vars = (*env)->vars;
-  *tmp = acons(root, sym, val, vars);
+  *tmp = acons(sym, val, vars);
+  write_barrier(*env);
   (*env)->vars = *tmp;
 }
 
 // Returns a newly created environment frame.
-static Obj *push_env(void *root, Obj **env, Obj **vars, Obj **vals) {
+static Obj *push_env(Obj **env, Obj **vars, Obj **vals) {
   DEFINE3(map, sym, val);
   *map = Nil;
-  for (; (*vars)->type == TCELL; *vars = (*vars)->cdr, *vals = (*vals)->cdr) {
-    if ((*vals)->type != TCELL)
+  for (; type_of((*vars)) == TCELL; *vars = (*vars)->cdr, *vals = (*vals)->cdr) {
+    if (type_of((*vals)) != TCELL)
       error("Cannot apply function: number of argument does not match");
     *sym = (*vars)->car;
     *val = (*vals)->car;
-    *map = acons(root, sym, val, map);
+    *map = acons(sym, val, map);
   }
   if (*vars != Nil)
-    *map = acons(root, vars, vals, map);
-  return make_env(root, map, env);
+    *map = acons(vars, vals, map);
+  return make_env(map, env);
+}
+
+// The number of root stack slots push_stack_env() needs for the parameters.
+static int stack_env_size(Obj *vars) {
+  int n = 0;
+  for (; type_of(vars) == TCELL; vars = vars->cdr)
+    n++;
+  if (vars != Nil)
+    n++;
+  // Two cells for each variable, one for the frame, and a slot to align them
+  return n * 4 + 3;
+}
+
+// Returns a new environment frame like push_env(), but made of the cells in the given root stack
+// slots, which must have been reserved with stack_env_size(). GC treats the contents of the slots
+// as roots, and the cells themselves are outside the heap, so they are never moved.
+static Obj *push_stack_env(Obj **slots, Obj **env, Obj **vars, Obj **vals) {
+  Obj **p = (uintptr_t)slots % OBJ_ALIGN ? slots + 1 : slots;
+  Obj *map = Nil;
+  Obj *v = *vars, *a = *vals;
+  for (; type_of(v) == TCELL; v = v->cdr, a = a->cdr) {
+    if (type_of(a) != TCELL)
+      error("Cannot apply function: number of argument does not match");
+    Obj *bind = cell_at((uint8_t *)p);
+    bind->car = v->car;
+    bind->cdr = a->car;
+    Obj *cell = cell_at((uint8_t *)(p + 2));
+    cell->car = bind;
+    cell->cdr = map;
+    map = cell;
+    p += 4;
+  }
+  if (v != Nil) {
+    Obj *bind = cell_at((uint8_t *)p);
+    bind->car = v;
+    bind->cdr = a;
+    Obj *cell = cell_at((uint8_t *)(p + 2));
+    cell->car = bind;
+    cell->cdr = map;
+    map = cell;
+    p += 4;
+  }
+  Obj *frame = cell_at((uint8_t *)p);
+  frame->vars = map;
+  frame->up = *env;
+  return frame;
 }
 
 // Evaluates the list elements from head and returns the last return value.
-static Obj *progn(void *root, Obj **env, Obj **list) {
+static Obj *progn(Obj **env, Obj **list) {
   DEFINE2(lp, r);
   for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
     *r = (*lp)->car;
-    *r = eval(root, env, r);
+    *r = eval(env, r);
   }
   return *r;
 }
 
 // Evaluates all the list elements and returns their return values as a new list.
-static Obj *eval_list(void *root, Obj **env, Obj **list) {
+static Obj *eval_list(Obj **env, Obj **list) {
   DEFINE4(head, lp, expr, result);
   *head = Nil;
   for (lp = list; *lp != Nil; *lp = (*lp)->cdr) {
     *expr = (*lp)->car;
-    *result = eval(root, env, expr);
-    *head = cons(root, result, head);
+    *result = eval(env, expr);
+    *head = cons(result, head);
   }
   return reverse(*head);
 }
 
 static bool is_list(Obj *obj) {
-  return obj == Nil || obj->type == TCELL;
+  return obj == Nil || type_of(obj) == TCELL;
 }
 
-static Obj *apply_func(void *root, Obj **env, Obj **fn, Obj **args) {
+static void prof_push(Obj *fn);
+
+static Obj *call_function(Obj **env, Obj **fn, Obj **args) {
   DEFINE3(params, newenv, body);
   *params = (*fn)->params;
   *newenv = (*fn)->env;
-  *newenv = push_env(root, newenv, params, args);
-  *body = (*fn)->body;
-  return progn(root, newenv, body);
+  if ((*fn)->jit && jit_thread) {
+    *newenv = push_env(newenv, params, args);
+    JitCode *code = jit_code(fn, newenv);
+    if (code)
+      return code(newenv);
+    *body = optimized_body(fn);
+    return progn(newenv, body);
+  }
+  *body = optimized_body(fn);
+  if (!((*fn)->noescape & (*body == (*fn)->body ? NOESCAPE_BODY : NOESCAPE_OPT))) {
+    *newenv = push_env(newenv, params, args);
+    return progn(newenv, body);
+  }
+  {
+    int size = stack_env_size(*params);
+    ADD_ROOT(size);
+    *newenv = push_stack_env(root_sp - size, newenv, params, args);
+    return progn(newenv, body);
+  }
+}
+
+// Counts a call of the function against the limits and records it for the profiler. The caller
+// decrements depth when the function returns.
+static inline void enter_function(Obj *fn) {
+  safepoint();
+  if (depth_limit <= depth)
+    error("Too deep recursion");
+  if (prof_stack)
+    prof_push(fn);
+  depth++;
+}
+
+static Obj *apply_func(Obj **env, Obj **fn, Obj **args) {
+  enter_function(*fn);
+  Obj *r = call_function(env, fn, args);
+  depth--;
+  return r;
+}
+
+// Expands a macro call for the optimizer or the JIT compiler. Returns NULL if the expansion fails
+// or has a side effect, in which case the form is left to be expanded when it is evaluated. The
+// expansion does not use up the fuel, as the form may never be evaluated.
+static Obj *expand_early(Obj **genv, Obj **macro, Obj **args) {
+  jmp_buf jb;
+  jmp_buf *saved_handler = error_handler;
+  Obj **sp = root_sp;
+  int saved_depth = depth;
+  long saved_fuel = fuel;
+  bool saved_expanding = expanding_early;
+  Obj *r;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    expanding_early = true;
+    r = apply_func(genv, macro, args);
+  } else {
+    root_sp = sp;
+    depth = saved_depth;
+    r = NULL;
+  }
+  error_handler = saved_handler;
+  expanding_early = saved_expanding;
+  fuel = saved_fuel;
+  return r;
 }
 
 // Apply fn with args.
-static Obj *apply(void *root, Obj **env, Obj **fn, Obj **args) {
+static Obj *apply(Obj **env, Obj **fn, Obj **args) {
   if (!is_list(*args))
     error("argument must be a list");
-  if ((*fn)->type == TPRIMITIVE)
-    return (*fn)->fn(root, env, args);
-  if ((*fn)->type == TFUNCTION) {
+  if (type_of((*fn)) == TPRIMITIVE)
+    return (*fn)->fn(env, args);
+  if (type_of((*fn)) == TFUNCTION) {
     DEFINE1(eargs);
-    *eargs = eval_list(root, env, args);
-    return apply_func(root, env, fn, eargs);
+    *eargs = eval_list(env, args);
+    return apply_func(env, fn, eargs);
   }
   error("not supported");
 }
@@ -671,21 +1561,21 @@ static Obj *find(Obj **env, Obj *sym) {
 }
 
 // Expands the given macro application form.
-static Obj *macroexpand(void *root, Obj **env, Obj **obj) {
-  if ((*obj)->type != TCELL || (*obj)->car->type != TSYMBOL)
+static Obj *macroexpand(Obj **env, Obj **obj) {
+  if (type_of((*obj)) != TCELL || type_of((*obj)->car) != TSYMBOL)
     return *obj;
   DEFINE3(bind, macro, args);
   *bind = find(env, (*obj)->car);
-  if (!*bind || (*bind)->cdr->type != TMACRO)
+  if (!*bind || type_of((*bind)->cdr) != TMACRO)
     return *obj;
   *macro = (*bind)->cdr;
   *args = (*obj)->cdr;
-  return apply_func(root, env, macro, args);
+  return apply_func(env, macro, args);
 }
 
 // Evaluates the S expression.
-static Obj *eval(void *root, Obj **env, Obj **obj) {
-  switch ((*obj)->type) {
+static Obj *eval(Obj **env, Obj **obj) {
+  switch (type_of((*obj))) {
   case TINT:
   case TPRIMITIVE:
   case TFUNCTION:
@@ -703,322 +1593,3883 @@ static Obj *eval(void *root, Obj **env, Obj **obj) {
   case TCELL: {
     // Function application form
     DEFINE3(fn, expanded, args);
-    *expanded = macroexpand(root, env, obj);
+    *expanded = macroexpand(env, obj);
     if (*expanded != *obj)
-      return eval(root, env, expanded);
+      return eval(env, expanded);
     *fn = (*obj)->car;
-    *fn = eval(root, env, fn);
+    *fn = eval(env, fn);
     *args = (*obj)->cdr;
-    if ((*fn)->type != TPRIMITIVE && (*fn)->type != TFUNCTION)
+    if (type_of((*fn)) != TPRIMITIVE && type_of((*fn)) != TFUNCTION)
       error("The head of a list must be a function");
-    return apply(root, env, fn, args);
+    return apply(env, fn, args);
   }
   default:
-    error("Bug: eval: Unknown tag type: %d", (*obj)->type);
+    error("Bug: eval: Unknown tag type: %d", type_of((*obj)));
   }
 }
 
 //======================================================================
-// Primitive functions and special forms
+// Parallel map
+//
+// pmap applies a function to each element of a list on a pool of worker threads. Each worker has
+// its own heap (a nursery) and never allocates in the caller's heap, which stays frozen while the
+// workers run. The function and the list are read directly from the caller's heap; writing to them
+// is an error. When all workers are done, the caller runs GC with the workers' heaps as additional
+// from-spaces, which copies the results into its own heap in one pass.
+//
+// The list is split into one contiguous range per worker. A worker that runs out of its own range
+// steals the second half of another worker's remaining range.
 //======================================================================
 
-// 'expr
-static Obj *prim_quote(void *root, Obj **env, Obj **list) {
-  if (length(*list) != 1)
-    error("Malformed quote");
-  return (*list)->car;
-}
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  int lo, hi;      // the range of element indices not taken yet; protected by lock
+  Space heap;      // the worker's heap after the task
+  Obj *results;    // ((index . value) ...) in the worker's heap
+  long fuel_used;  // the resources used for the task, charged to the caller
+  size_t alloc_used;
+  bool failed;
+  char msg[sizeof(error_msg)];
+} Worker;
 
-// (cons expr expr)
-static Obj *prim_cons(void *root, Obj **env, Obj **list) {
-  if (length(*list) != 2)
+static struct {
+  pthread_mutex_t busy;  // held by the thread calling pmap
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  int generation;        // incremented for each task
+  int running;           // the number of workers still working on the task
+  Worker *workers;
+  int nworkers;
+  // The task
+  Obj *fn;
+  Obj **elems;
+  FILE *output;
+  int epoch;
+  long fuel;     // the caller's remaining fuel, depth and allocation quota
+  int depth;
+  size_t alloc;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           PTHREAD_COND_INITIALIZER };
+
+// Returns the index of the next element to process, or -1 if none is left.
+static int take_work(Worker *self) {
+  pthread_mutex_lock(&self->lock);
+  int i = self->lo < self->hi ? self->lo++ : -1;
+  pthread_mutex_unlock(&self->lock);
+  for (int k = 1; i < 0 && k < pool.nworkers; k++) {
+    Worker *victim = &pool.workers[(self - pool.workers + k) % pool.nworkers];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->lo < victim->hi) {
+      int mid = victim->lo + (victim->hi - victim->lo) / 2;
+      pthread_mutex_lock(&self->lock);
+      self->lo = mid + 1;
+      self->hi = victim->hi;
+      pthread_mutex_unlock(&self->lock);
+      victim->hi = mid;
+      i = mid;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  return i;
+}
+
+static void run_pmap_task(Worker *self) {
+  // The previous results have already been copied to the caller's heap.
+  abort_gc_cycle();
+  heap.ncells = heap.nobjs = 0;
+  output = pool.output;
+  defs_epoch = pool.epoch;
+  self->failed = false;
+  fuel = pool.fuel;
+  depth = pool.depth;
+  size_t allocated = gc_stats.allocated;
+  alloc_limit = pool.alloc == SIZE_MAX ? SIZE_MAX : allocated + pool.alloc;
+
+  DEFINE4(fn, results, args, value);
+  *fn = pool.fn;
+  *results = Nil;
+  Obj **sp = root_sp;
+  jmp_buf jb;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    for (int i; 0 <= (i = take_work(self));) {
+      *args = cons(&pool.elems[i], &Nil);
+      *value = apply_func(fn, fn, args);
+      *args = make_int(i);
+      *results = acons(args, value, results);
+    }
+    self->fuel_used = pool.fuel - fuel;
+    self->alloc_used = gc_stats.allocated - allocated;
+    // Leave only the results in the heap, so that the caller can scan it.
+    compact_heap();
+  } else {
+    self->failed = true;
+    strcpy(self->msg, error_msg);
+    gc_running = false;
+    root_sp = sp;
+    self->fuel_used = pool.fuel - fuel;
+    self->alloc_used = gc_stats.allocated - allocated;
+    // Let the other workers finish quickly.
+    for (int i = 0; 0 <= i; i = take_work(self));
+    heap.ncells = heap.nobjs = 0;
+  }
+  error_handler = NULL;
+  self->heap = heap;
+  self->results = *results;
+}
+
+static void *pmap_worker(void *arg) {
+  Worker *self = arg;
+  in_pmap_worker = true;
+  init_root_stack();
+  init_heap();
+  int generation = 0;
+  for (;;) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.generation == generation)
+      pthread_cond_wait(&pool.start, &pool.lock);
+    generation = pool.generation;
+    pthread_mutex_unlock(&pool.lock);
+
+    run_pmap_task(self);
+
+    pthread_mutex_lock(&pool.lock);
+    if (--pool.running == 0)
+      pthread_cond_signal(&pool.done);
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return NULL;
+}
+
+static void start_pool(void) {
+  char *val = getenv("MINILISP_THREADS");
+  int n = val ? atoi(val) : sysconf(_SC_NPROCESSORS_ONLN);
+  // Each worker's heap becomes a root area of the calling thread after a task.
+  pool.nworkers = n < 1 ? 1 : n < MAX_ROOT_AREAS ? n : MAX_ROOT_AREAS;
+  pool.workers = calloc(pool.nworkers, sizeof(Worker));
+  for (int i = 0; i < pool.nworkers; i++) {
+    pthread_mutex_init(&pool.workers[i].lock, NULL);
+    if (pthread_create(&pool.workers[i].thread, NULL, pmap_worker, &pool.workers[i])) {
+      // Make do with the threads already started, if any.
+      pool.nworkers = i;
+      if (i == 0) {
+        free(pool.workers);
+        pool.workers = NULL;
+        pthread_mutex_unlock(&pool.busy);
+        error("Cannot create a thread");
+      }
+      break;
+    }
+  }
+}
+
+// Lets the next pmap call use the pool.
+static void release_pool(void) {
+  nroot_areas = 0;
+  pthread_mutex_unlock(&pool.busy);
+}
+
+// Copies an object in a worker's heap to this heap. The copy is scanned later.
+static Obj *import(Obj *obj) {
+  bool foreign = false;
+  for (int i = 0; i < nroot_areas && !foreign; i++)
+    foreign = in_space(&root_areas[i], obj);
+  if (!foreign)
+    return obj;
+  if (is_moved(obj))
+    return moved_to(obj);
+  Obj *newloc = alloc_raw(is_cell(obj), obj_size(obj));
+  if (!newloc)
+    error("Memory exhausted");
+  copy_obj(newloc, obj);
+  set_moved(obj, newloc);
+  gc_push(newloc);
+  return newloc;
+}
+
+// Applies fn to each element of list on the current thread.
+static Obj *map_sequential(Obj **fn, Obj **list) {
+  DEFINE4(lp, head, args, value);
+  *head = Nil;
+  for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+    *args = (*lp)->car;
+    *args = cons(args, &Nil);
+    *value = apply_func(fn, fn, args);
+    *head = cons(value, head);
+  }
+  return reverse(*head);
+}
+
+static Obj *pmap(Obj **fn, Obj **list) {
+  int n = length(*list);
+  // A worker cannot start another parallel task, nor can two threads use the pool at once. Fall
+  // back to the sequential map in such cases.
+  if (n < 2 || in_pmap_worker || pthread_mutex_trylock(&pool.busy))
+    return map_sequential(fn, list);
+  if (!pool.workers)
+    start_pool();
+
+  // The list to store the results. No GC happens in this heap from now until all results are
+  // stored, so we can keep raw pointers to the elements and the result cells in C arrays.
+  DEFINE1(result);
+  *result = Nil;
+  for (int i = 0; i < n; i++)
+    *result = cons(&Nil, result);
+  if (gc_cycle)
+    finish_gc_cycle();
+  Obj **elems = malloc(sizeof(Obj *) * n);
+  Obj **cells = malloc(sizeof(Obj *) * n);
+  Obj *p = *list, *q = *result;
+  for (int i = 0; i < n; i++, p = p->cdr, q = q->cdr) {
+    elems[i] = p->car;
+    cells[i] = q;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  pool.fn = *fn;
+  pool.elems = elems;
+  pool.output = output;
+  pool.epoch = defs_epoch;
+  // Each worker may use up to what is left of the caller's limits, and the total used by all of
+  // them is charged to the caller afterwards. Whether the limits are exceeded therefore does not
+  // depend on how the elements are divided among the workers.
+  pool.fuel = fuel;
+  pool.depth = depth;
+  pool.alloc = alloc_limit == SIZE_MAX ? SIZE_MAX
+             : alloc_limit <= gc_stats.allocated ? 0 : alloc_limit - gc_stats.allocated;
+  shared_heap = heap;
+  for (int i = 0; i < pool.nworkers; i++) {
+    pool.workers[i].lo = (long)n * i / pool.nworkers;
+    pool.workers[i].hi = (long)n * (i + 1) / pool.nworkers;
+  }
+  pool.running = pool.nworkers;
+  pool.generation++;
+  pthread_cond_broadcast(&pool.start);
+  while (pool.running)
+    pthread_cond_wait(&pool.done, &pool.lock);
+  pthread_mutex_unlock(&pool.lock);
+  free(elems);
+
+  char *msg = NULL;
+  size_t total = 0, alloc_used = 0;
+  for (int i = 0; i < pool.nworkers; i++) {
+    Worker *w = &pool.workers[i];
+    fuel -= w->fuel_used;
+    alloc_used += w->alloc_used;
+    if (w->failed) {
+      msg = w->msg;
+      continue;
+    }
+    for (Obj *r = w->results; r != Nil; r = r->cdr)
+      cells[r->car->car->value]->car = r->car->cdr;
+    root_areas[nroot_areas++] = w->heap;
+    total += space_used(&w->heap);
+  }
+  free(cells);
+  if (alloc_limit != SIZE_MAX)
+    alloc_limit = alloc_used < alloc_limit ? alloc_limit - alloc_used : 0;
+  if (!msg && fuel < 0)
+    msg = "Fuel exhausted";
+  if (!msg && alloc_limit <= gc_stats.allocated)
+    msg = "Allocation quota exceeded";
+  if (fuel < 0)
+    fuel = 0;
+  if (msg) {
+    release_pool();
+    error("%s", msg);
+  }
+
+  // Copy the results to this heap. If there may not be enough space, run GC first, with the
+  // workers' heaps as roots because their objects may point to objects in this heap. Either may
+  // run out of memory, in which case the pool must be released before the error propagates.
+  jmp_buf jb;
+  jmp_buf *saved_handler = error_handler;
+  Obj **sp = root_sp;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    if (MEMORY_SIZE < space_used(&heap) + total)
+      gc();
+    // The copies were already charged to the allocation quota when the workers made them.
+    size_t allocated = gc_stats.allocated;
+    for (Obj *p = *result; p != Nil; p = p->cdr)
+      p->car = import(p->car);
+    while (gc_sp)
+      scan_fields(gc_stack[--gc_sp], import);
+    if (alloc_limit != SIZE_MAX)
+      alloc_limit += gc_stats.allocated - allocated;
+  } else {
+    char buf[sizeof(error_msg)];
+    strcpy(buf, error_msg);
+    error_handler = saved_handler;
+    root_sp = sp;
+    gc_sp = 0;
+    release_pool();
+    error("%s", buf);
+  }
+  error_handler = saved_handler;
+  release_pool();
+  return *result;
+}
+
+//======================================================================
+// Primitive functions and special forms
+//======================================================================
+
+// 'expr
+static Obj *prim_quote(Obj **env, Obj **list) {
+  if (length(*list) != 1)
+    error("Malformed quote");
+  return (*list)->car;
+}
+
+enum { QUASIQUOTE = 1, UNQUOTE, UNQUOTE_SPLICING };
+
+// Returns QUASIQUOTE, UNQUOTE or UNQUOTE_SPLICING if the object is (quasiquote expr), (unquote
+// expr) or (unquote-splicing expr), or 0 otherwise.
+static int quote_kind(Obj *obj) {
+  if (type_of(obj) != TCELL || type_of(obj->car) != TSYMBOL || type_of(obj->cdr) != TCELL ||
+      obj->cdr->cdr != Nil)
+    return 0;
+  char *name = obj->car->name;
+  if (!strcmp(name, "quasiquote"))
+    return QUASIQUOTE;
+  if (!strcmp(name, "unquote"))
+    return UNQUOTE;
+  if (!strcmp(name, "unquote-splicing"))
+    return UNQUOTE_SPLICING;
+  return 0;
+}
+
+// Returns (<head> <value>) for a nested quote form, or the form itself if the value is the same.
+static Obj *requote(Obj **form, Obj **value) {
+  if (*value == (*form)->cdr->car)
+    return *form;
+  DEFINE2(head, tmp);
+  *head = (*form)->car;
+  *tmp = cons(value, &Nil);
+  return cons(head, tmp);
+}
+
+// Builds the value of a quasiquote template in a single pass. depth is the number of quasiquotes
+// the template is nested in, besides the one being evaluated. The parts of the template without
+// an unquote are not copied, so the value shares them with the template.
+static Obj *quasiquote(Obj **env, Obj **tmpl, int depth) {
+  if (type_of(*tmpl) != TCELL)
+    return *tmpl;
+  DEFINE3(head, tail, p);
+  int kind = quote_kind(*tmpl);
+  if (kind) {
+    *head = (*tmpl)->cdr->car;
+    if (kind == QUASIQUOTE || depth > 0) {
+      *head = quasiquote(env, head, kind == QUASIQUOTE ? depth + 1 : depth - 1);
+      return requote(tmpl, head);
+    }
+    if (kind == UNQUOTE_SPLICING)
+      error("unquote-splicing outside of a list");
+    return eval(env, head);
+  }
+
+  if (depth == 0 && quote_kind((*tmpl)->car) == UNQUOTE_SPLICING) {
+    // ,@expr copies the list so that the rest of the template can be appended to it, unless it
+    // is at the end.
+    *head = (*tmpl)->car->cdr->car;
+    *head = eval(env, head);
+    *tail = (*tmpl)->cdr;
+    *tail = quasiquote(env, tail, depth);
+    if (*tail == Nil)
+      return *head;
+    if (length(*head) < 0)
+      error("unquote-splicing takes a list");
+    if (*head == Nil)
+      return *tail;
+    DEFINE2(copy, obj);
+    *copy = Nil;
+    for (*p = *head; *p != Nil; *p = (*p)->cdr) {
+      *obj = (*p)->car;
+      *copy = cons(obj, copy);
+    }
+    Obj *ret = reverse(*copy);
+    write_barrier(*copy);
+    (*copy)->cdr = *tail;
+    return ret;
+  }
+
+  *head = (*tmpl)->car;
+  *head = quasiquote(env, head, depth);
+  *tail = (*tmpl)->cdr;
+  *tail = quasiquote(env, tail, depth);
+  if (*head == (*tmpl)->car && *tail == (*tmpl)->cdr)
+    return *tmpl;
+  return cons(head, tail);
+}
+
+// `expr
+static Obj *prim_quasiquote(Obj **env, Obj **list) {
+  if (length(*list) != 1)
+    error("Malformed quasiquote");
+  DEFINE1(tmpl);
+  *tmpl = (*list)->car;
+  return quasiquote(env, tmpl, 0);
+}
+
+// (cons expr expr)
+static Obj *prim_cons(Obj **env, Obj **list) {
+  if (length(*list) != 2)
     error("Malformed cons");
-  Obj *cell = eval_list(root, env, list);
+  Obj *cell = eval_list(env, list);
+  write_barrier(cell);
   cell->cdr = cell->cdr->car;
   return cell;
 }
 
 // (car <cell>)
-static Obj *prim_car(void *root, Obj **env, Obj **list) {
-  Obj *args = eval_list(root, env, list);
-  if (args->car->type != TCELL || args->cdr != Nil)
+static Obj *prim_car(Obj **env, Obj **list) {
+  Obj *args = eval_list(env, list);
+  if (type_of(args->car) != TCELL || args->cdr != Nil)
     error("Malformed car");
   return args->car->car;
 }
 
 // (cdr <cell>)
-static Obj *prim_cdr(void *root, Obj **env, Obj **list) {
-  Obj *args = eval_list(root, env, list);
-  if (args->car->type != TCELL || args->cdr != Nil)
+static Obj *prim_cdr(Obj **env, Obj **list) {
+  Obj *args = eval_list(env, list);
+  if (type_of(args->car) != TCELL || args->cdr != Nil)
     error("Malformed cdr");
   return args->car->cdr;
 }
 
 // (setq <symbol> expr)
-static Obj *prim_setq(void *root, Obj **env, Obj **list) {
-  if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
+static Obj *prim_setq(Obj **env, Obj **list) {
+  if (length(*list) != 2 || type_of((*list)->car) != TSYMBOL)
     error("Malformed setq");
   DEFINE2(bind, value);
   *bind = find(env, (*list)->car);
   if (!*bind)
     error("Unbound variable %s", (*list)->car->name);
+  check_writable(*bind, "setq");
   *value = (*list)->cdr->car;
-  *value = eval(root, env, value);
+  *value = eval(env, value);
+  note_binding((*bind)->cdr, *value);
+  write_barrier(*bind);
   (*bind)->cdr = *value;
   return *value;
 }
 
 // (setcar <cell> expr)
-static Obj *prim_setcar(void *root, Obj **env, Obj **list) {
+static Obj *prim_setcar(Obj **env, Obj **list) {
   DEFINE1(args);
-  *args = eval_list(root, env, list);
-  if (length(*args) != 2 || (*args)->car->type != TCELL)
+  *args = eval_list(env, list);
+  if (length(*args) != 2 || type_of((*args)->car) != TCELL)
     error("Malformed setcar");
+  check_writable((*args)->car, "setcar");
+  write_barrier((*args)->car);
   (*args)->car->car = (*args)->cdr->car;
   return (*args)->car;
 }
 
 // (while cond expr ...)
-static Obj *prim_while(void *root, Obj **env, Obj **list) {
+static Obj *prim_while(Obj **env, Obj **list) {
   if (length(*list) < 2)
     error("Malformed while");
   DEFINE2(cond, exprs);
   *cond = (*list)->car;
-  while (eval(root, env, cond) != Nil) {
+  while (eval(env, cond) != Nil) {
+    safepoint();
     *exprs = (*list)->cdr;
-    eval_list(root, env, exprs);
+    eval_list(env, exprs);
   }
   return Nil;
 }
 
-// (gensym)
-static Obj *prim_gensym(void *root, Obj **env, Obj **list) {
-  static int count = 0;
-  char buf[10];
-  snprintf(buf, sizeof(buf), "G__%d", count++);
-  return make_symbol(root, buf);
+// The counter to make a unique symbol name for gensym
+static THREAD_LOCAL int gensym_count = 0;
+static THREAD_LOCAL int early_gensym_count = 0;
+
+// (gensym). The symbols made by early macro expansions are numbered separately, so that those
+// expansions do not change the names of the symbols the program makes.
+static Obj *prim_gensym(Obj **env, Obj **list) {
+  char buf[16];
+  if (expanding_early)
+    snprintf(buf, sizeof(buf), "G__e%d", early_gensym_count++);
+  else
+    snprintf(buf, sizeof(buf), "G__%d", gensym_count++);
+  return make_symbol(buf);
+}
+
+// (pmap fn list)
+static Obj *prim_pmap(Obj **env, Obj **list) {
+  DEFINE2(fn, args);
+  *args = eval_list(env, list);
+  if (length(*args) != 2 || type_of((*args)->car) != TFUNCTION || !is_list((*args)->cdr->car) ||
+      length((*args)->cdr->car) < 0)
+    error("Malformed pmap");
+  *fn = (*args)->car;
+  *args = (*args)->cdr->car;
+  return pmap(fn, args);
 }
 
 // (+ <integer> ...)
-static Obj *prim_plus(void *root, Obj **env, Obj **list) {
+static Obj *prim_plus(Obj **env, Obj **list) {
   int sum = 0;
-  for (Obj *args = eval_list(root, env, list); args != Nil; args = args->cdr) {
-    if (args->car->type != TINT)
+  for (Obj *args = eval_list(env, list); args != Nil; args = args->cdr) {
+    if (type_of(args->car) != TINT)
       error("+ takes only numbers");
     sum += args->car->value;
   }
-  return make_int(root, sum);
+  return make_int(sum);
 }
 
 // (- <integer> ...)
-static Obj *prim_minus(void *root, Obj **env, Obj **list) {
-  Obj *args = eval_list(root, env, list);
+static Obj *prim_minus(Obj **env, Obj **list) {
+  Obj *args = eval_list(env, list);
   for (Obj *p = args; p != Nil; p = p->cdr)
-    if (p->car->type != TINT)
+    if (type_of(p->car) != TINT)
       error("- takes only numbers");
   if (args->cdr == Nil)
-    return make_int(root, -args->car->value);
+    return make_int(-args->car->value);
   int r = args->car->value;
   for (Obj *p = args->cdr; p != Nil; p = p->cdr)
     r -= p->car->value;
-  return make_int(root, r);
+  return make_int(r);
 }
 
 // (< <integer> <integer>)
-static Obj *prim_lt(void *root, Obj **env, Obj **list) {
-  Obj *args = eval_list(root, env, list);
+static Obj *prim_lt(Obj **env, Obj **list) {
+  Obj *args = eval_list(env, list);
   if (length(args) != 2)
     error("malformed <");
   Obj *x = args->car;
   Obj *y = args->cdr->car;
-  if (x->type != TINT || y->type != TINT)
+  if (type_of(x) != TINT || type_of(y) != TINT)
     error("< takes only numbers");
   return x->value < y->value ? True : Nil;
 }
 
-static Obj *handle_function(void *root, Obj **env, Obj **list, int type) {
-  if ((*list)->type != TCELL || !is_list((*list)->car) || (*list)->cdr->type != TCELL)
+static Obj *handle_function(Obj **env, Obj **list, int type) {
+  if (type_of((*list)) != TCELL || !is_list((*list)->car) || type_of((*list)->cdr) != TCELL)
     error("Malformed lambda");
   Obj *p = (*list)->car;
-  for (; p->type == TCELL; p = p->cdr)
-    if (p->car->type != TSYMBOL)
+  for (; type_of(p) == TCELL; p = p->cdr)
+    if (type_of(p->car) != TSYMBOL)
       error("Parameter must be a symbol");
-  if (p != Nil && p->type != TSYMBOL)
+  if (p != Nil && type_of(p) != TSYMBOL)
     error("Parameter must be a symbol");
   DEFINE2(params, body);
   *params = (*list)->car;
   *body = (*list)->cdr; // this DEFINE2 is readlly neccesary ???
-  return make_function(root, env, type, params, body);
+  Obj *r = make_function(env, type, params, body);
+  if (!creates_closure(*body))
+    r->noescape = NOESCAPE_BODY;
+  return r;
 }
 
 // (lambda (<symbol> ...) expr ...)
-static Obj *prim_lambda(void *root, Obj **env, Obj **list) {
-  return handle_function(root, env, list, TFUNCTION);
+static Obj *prim_lambda(Obj **env, Obj **list) {
+  return handle_function(env, list, TFUNCTION);
 }
 
-static Obj *handle_defun(void *root, Obj **env, Obj **list, int type) {
-  if ((*list)->car->type != TSYMBOL || (*list)->cdr->type != TCELL)
+static Obj *handle_defun(Obj **env, Obj **list, int type) {
+  if (type_of((*list)->car) != TSYMBOL || type_of((*list)->cdr) != TCELL)
     error("Malformed defun");
   DEFINE3(fn, sym, rest);
   *sym = (*list)->car;
   *rest = (*list)->cdr;
-  *fn = handle_function(root, env, rest, type);
-  add_variable(root, env, sym, fn);
+  *fn = handle_function(env, rest, type);
+  if (type == TFUNCTION && (*env)->up == Nil)
+    (*fn)->jit = jit_register(Nil);
+  add_variable(env, sym, fn);
   return *fn;
 }
 
 // (defun <symbol> (<symbol> ...) expr ...)
-static Obj *prim_defun(void *root, Obj **env, Obj **list) {
-  return handle_defun(root, env, list, TFUNCTION);
+static Obj *prim_defun(Obj **env, Obj **list) {
+  return handle_defun(env, list, TFUNCTION);
 }
 
 // (define <symbol> expr)
-static Obj *prim_define(void *root, Obj **env, Obj **list) {
-  if (length(*list) != 2 || (*list)->car->type != TSYMBOL)
+static Obj *prim_define(Obj **env, Obj **list) {
+  if (length(*list) != 2 || type_of((*list)->car) != TSYMBOL)
     error("Malformed define");
   DEFINE2(sym, value);
   *sym = (*list)->car;
   *value = (*list)->cdr->car;
-  *value = eval(root, env, value);
-  add_variable(root, env, sym, value);
+  *value = eval(env, value);
+  add_variable(env, sym, value);
   return *value;
 }
 
 // (defmacro <symbol> (<symbol> ...) expr ...)
-static Obj *prim_defmacro(void *root, Obj **env, Obj **list) {
-  return handle_defun(root, env, list, TMACRO);
+static Obj *prim_defmacro(Obj **env, Obj **list) {
+  return handle_defun(env, list, TMACRO);
 }
 
 // (macroexpand expr)
-static Obj *prim_macroexpand(void *root, Obj **env, Obj **list) {
+static Obj *prim_macroexpand(Obj **env, Obj **list) {
   if (length(*list) != 1)
     error("Malformed macroexpand");
   DEFINE1(body);
   *body = (*list)->car;
-  return macroexpand(root, env, body);
+  return macroexpand(env, body);
 }
 
 // (println expr)
-static Obj *prim_println(void *root, Obj **env, Obj **list) {
+static Obj *prim_println(Obj **env, Obj **list) {
+  check_effect("println");
   DEFINE1(tmp);
   *tmp = (*list)->car;
-  print(eval(root, env, tmp));
-  printf("\n");
+  print(eval(env, tmp));
+  fprintf(output, "\n");
   return Nil;
 }
 
 // (if expr expr expr ...)
-static Obj *prim_if(void *root, Obj **env, Obj **list) {
+static Obj *prim_if(Obj **env, Obj **list) {
   if (length(*list) < 2)
     error("Malformed if");
   DEFINE3(cond, then, els);
   *cond = (*list)->car;
-  *cond = eval(root, env, cond);
+  *cond = eval(env, cond);
   if (*cond != Nil) {
     *then = (*list)->cdr->car;
-    return eval(root, env, then);
+    return eval(env, then);
   }
   *els = (*list)->cdr->cdr;
-  return *els == Nil ? Nil : progn(root, env, els);
+  return *els == Nil ? Nil : progn(env, els);
+}
+
+// (progn expr ...)
+static Obj *prim_progn(Obj **env, Obj **list) {
+  if (length(*list) < 0)
+    error("Malformed progn");
+  return *list == Nil ? Nil : progn(env, list);
+}
+
+// True if the list is ((<symbol> expr) ...), as in let.
+static bool is_let_bindings(Obj *list) {
+  for (; type_of(list) == TCELL; list = list->cdr)
+    if (length(list->car) != 2 || type_of(list->car->car) != TSYMBOL)
+      return false;
+  return list == Nil;
+}
+
+// (let ((<symbol> expr) ...) expr ...)
+//
+// Binds the values of the expressions to the symbols like an immediately applied lambda, but
+// without making a closure.
+static Obj *prim_let(Obj **env, Obj **list) {
+  if (length(*list) < 2 || !is_let_bindings((*list)->car))
+    error("Malformed let");
+  DEFINE4(lp, expr, vars, vals);
+  *vars = *vals = Nil;
+  for (*lp = (*list)->car; *lp != Nil; *lp = (*lp)->cdr) {
+    *expr = (*lp)->car->cdr->car;
+    *expr = eval(env, expr);
+    *vals = cons(expr, vals);
+    *expr = (*lp)->car->car;
+    *vars = cons(expr, vars);
+  }
+  *vars = reverse(*vars);
+  *vals = reverse(*vals);
+  *lp = push_env(env, vars, vals);
+  *expr = (*list)->cdr;
+  return progn(lp, expr);
+}
+
+// (cond (test expr ...) ...)
+//
+// Returns the value of the last expression of the first clause whose test is true, or the value
+// of the test if the clause has no expressions.
+static Obj *prim_cond(Obj **env, Obj **list) {
+  if (length(*list) < 0)
+    error("Malformed cond");
+  DEFINE3(lp, clause, value);
+  for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+    *clause = (*lp)->car;
+    if (length(*clause) < 1)
+      error("Malformed cond");
+    *value = (*clause)->car;
+    *value = eval(env, value);
+    if (*value != Nil) {
+      *clause = (*clause)->cdr;
+      return *clause == Nil ? *value : progn(env, clause);
+    }
+  }
+  return Nil;
+}
+
+// (and expr ...)
+static Obj *prim_and(Obj **env, Obj **list) {
+  if (length(*list) < 0)
+    error("Malformed and");
+  DEFINE2(lp, value);
+  *value = True;
+  for (*lp = *list; *lp != Nil && *value != Nil; *lp = (*lp)->cdr) {
+    *value = (*lp)->car;
+    *value = eval(env, value);
+  }
+  return *value;
+}
+
+// (or expr ...)
+static Obj *prim_or(Obj **env, Obj **list) {
+  if (length(*list) < 0)
+    error("Malformed or");
+  DEFINE2(lp, value);
+  *value = Nil;
+  for (*lp = *list; *lp != Nil && *value == Nil; *lp = (*lp)->cdr) {
+    *value = (*lp)->car;
+    *value = eval(env, value);
+  }
+  return *value;
+}
+
+// True if the list is (<symbol> count [result]), as in dotimes.
+static bool is_dotimes_spec(Obj *list) {
+  int n = length(list);
+  return (n == 2 || n == 3) && type_of(list->car) == TSYMBOL;
+}
+
+// The steps of dotimes, also used by the compiled code. The variable is the counter: it is
+// bound to 0 in a new frame, and incremented after each iteration until it reaches the count.
+static Obj *dotimes_env(Obj **env, Obj *var, Obj *count) {
+  if (type_of(count) != TINT)
+    error("dotimes takes only numbers");
+  DEFINE2(vars, vals);
+  *vars = var;
+  *vars = cons(vars, &Nil);
+  *vals = make_int(0);
+  *vals = cons(vals, &Nil);
+  return push_env(env, vars, vals);
+}
+
+static int dotimes_counter(Obj *frame) {
+  Obj *i = frame->vars->car->cdr;
+  if (type_of(i) != TINT)
+    error("dotimes takes only numbers");
+  return i->value;
+}
+
+static Obj *dotimes_test(Obj **frame, Obj *count) {
+  safepoint();
+  return dotimes_counter(*frame) < count->value ? True : Nil;
+}
+
+static void dotimes_next(Obj **frame) {
+  Obj *i = make_int(dotimes_counter(*frame) + 1);
+  Obj *bind = (*frame)->vars->car;
+  write_barrier(bind);
+  bind->cdr = i;
+}
+
+// (dotimes (<symbol> count [result]) expr ...)
+static Obj *prim_dotimes(Obj **env, Obj **list) {
+  if (length(*list) < 1 || !is_dotimes_spec((*list)->car))
+    error("Malformed dotimes");
+  DEFINE3(count, frame, body);
+  *count = (*list)->car->cdr->car;
+  *count = eval(env, count);
+  *frame = dotimes_env(env, (*list)->car->car, *count);
+  for (*body = (*list)->cdr; dotimes_test(frame, *count) != Nil; dotimes_next(frame))
+    if (*body != Nil)
+      progn(frame, body);
+  *body = (*list)->car->cdr->cdr;
+  if (*body == Nil)
+    return Nil;
+  *body = (*body)->car;
+  return eval(frame, body);
 }
 
 // (= <integer> <integer>)
-static Obj *prim_num_eq(void *root, Obj **env, Obj **list) {
+static Obj *prim_num_eq(Obj **env, Obj **list) {
   if (length(*list) != 2)
     error("Malformed =");
-  Obj *values = eval_list(root, env, list);
+  Obj *values = eval_list(env, list);
   Obj *x = values->car;
   Obj *y = values->cdr->car;
-  if (x->type != TINT || y->type != TINT)
+  if (type_of(x) != TINT || type_of(y) != TINT)
     error("= only takes numbers");
   return x->value == y->value ? True : Nil;
 }
 
 // (eq expr expr)
-static Obj *prim_eq(void *root, Obj **env, Obj **list) {
+static Obj *prim_eq(Obj **env, Obj **list) {
   if (length(*list) != 2)
     error("Malformed eq");
-  Obj *values = eval_list(root, env, list);
+  Obj *values = eval_list(env, list);
   return values->car == values->cdr->car ? True : Nil;
 }
 
-static void add_primitive(void *root, Obj **env, char *name, Primitive *fn) {
+static void add_primitive(Obj **env, char *name, Primitive *fn) {
   DEFINE2(sym, prim);
-  *sym = intern(root, name);
-  *prim = make_primitive(root, fn);
-  add_variable(root, env, sym, prim);
+  *sym = intern(name);
+  *prim = make_primitive(fn);
+  add_variable(env, sym, prim);
 }
 
-static void define_constants(void *root, Obj **env) {
+static void define_constants(Obj **env) {
   DEFINE1(sym);
-  *sym = intern(root, "t");
-  add_variable(root, env, sym, &True);
-}
-
-static void define_primitives(void *root, Obj **env) {
-  add_primitive(root, env, "quote", prim_quote);
-  add_primitive(root, env, "cons", prim_cons);
-  add_primitive(root, env, "car", prim_car);
-  add_primitive(root, env, "cdr", prim_cdr);
-  add_primitive(root, env, "setq", prim_setq);
-  add_primitive(root, env, "setcar", prim_setcar);
-  add_primitive(root, env, "while", prim_while);
-  add_primitive(root, env, "gensym", prim_gensym);
-  add_primitive(root, env, "+", prim_plus);
-  add_primitive(root, env, "-", prim_minus);
-  add_primitive(root, env, "<", prim_lt);
-  add_primitive(root, env, "define", prim_define);
-  add_primitive(root, env, "defun", prim_defun);
-  add_primitive(root, env, "defmacro", prim_defmacro);
-  add_primitive(root, env, "macroexpand", prim_macroexpand);
-  add_primitive(root, env, "lambda", prim_lambda);
-  add_primitive(root, env, "if", prim_if);
-  add_primitive(root, env, "=", prim_num_eq);
-  add_primitive(root, env, "eq", prim_eq);
-  add_primitive(root, env, "println", prim_println);
+  *sym = intern("t");
+  add_variable(env, sym, &True);
+}
+
+static void define_primitives(Obj **env) {
+  add_primitive(env, "quote", prim_quote);
+  add_primitive(env, "quasiquote", prim_quasiquote);
+  add_primitive(env, "cons", prim_cons);
+  add_primitive(env, "car", prim_car);
+  add_primitive(env, "cdr", prim_cdr);
+  add_primitive(env, "setq", prim_setq);
+  add_primitive(env, "setcar", prim_setcar);
+  add_primitive(env, "while", prim_while);
+  add_primitive(env, "gensym", prim_gensym);
+  add_primitive(env, "+", prim_plus);
+  add_primitive(env, "-", prim_minus);
+  add_primitive(env, "<", prim_lt);
+  add_primitive(env, "define", prim_define);
+  add_primitive(env, "defun", prim_defun);
+  add_primitive(env, "defmacro", prim_defmacro);
+  add_primitive(env, "macroexpand", prim_macroexpand);
+  add_primitive(env, "lambda", prim_lambda);
+  add_primitive(env, "if", prim_if);
+  add_primitive(env, "progn", prim_progn);
+  add_primitive(env, "let", prim_let);
+  add_primitive(env, "cond", prim_cond);
+  add_primitive(env, "and", prim_and);
+  add_primitive(env, "or", prim_or);
+  add_primitive(env, "dotimes", prim_dotimes);
+  add_primitive(env, "=", prim_num_eq);
+  add_primitive(env, "eq", prim_eq);
+  add_primitive(env, "println", prim_println);
+  add_primitive(env, "pmap", prim_pmap);
 }
 
 //======================================================================
-// Entry point
+// Optimizer
+//
+// The body of a function or macro defined at the top level is rewritten when it is first called
+// into a form that is cheaper to evaluate, and the interpreter evaluates that instead:
+//
+//  - Macros are expanded once, rather than every time the form is evaluated. A macro whose
+//    expansion has a side effect is left to be expanded when the form is evaluated.
+//  - The head of a form naming a global primitive or function is replaced with the object
+//    itself, so that it is not looked up at runtime.
+//  - An immediately applied lambda, such as the expansion of let1 or progn, binds its arguments
+//    without creating a closure.
+//  - Arithmetic on integer literals and if on constants are folded.
+//  - A call of a small non-recursive global function is replaced with its body, unless the
+//    resource limits or the profiler count the calls.
+//
+// All of these assume that the global definitions do not change. The rewritten body is thrown
+// away and made again when a variable holding a function, macro or primitive is defined or
+// assigned, so the change takes effect from the next call of the function. Lambdas in the body
+// are rewritten along with it, and the closures made from them keep both bodies, so that they go
+// back to the original one after such a change. Functions that may add local variables with
+// define are not rewritten.
 //======================================================================
 
-// Returns true if the environment variable is defined and not the empty string.
-static bool getEnvFlag(char *name) {
-  char *val = getenv(name);
-  return val && val[0];
+// (%bind <params> (expr ...) expr ...) binds the values of the expressions to the parameters and
+// evaluates the body, as ((lambda <params> expr ...) expr ...) does without making a closure.
+// This, %bind-stack, %closure and %progn cannot be named in a program, so they cannot be redefined
+// either; they appear only in the optimized forms. %progn is progn.
+static Obj *prim_bind(Obj **env, Obj **list) {
+  DEFINE4(params, args, newenv, body);
+  *params = (*list)->car;
+  *args = (*list)->cdr->car;
+  *args = eval_list(env, args);
+  *newenv = push_env(env, params, args);
+  *body = (*list)->cdr->cdr;
+  return progn(newenv, body);
 }
 
-int main(int argc, char **argv) {
-  // Debug flags
-  debug_gc = getEnvFlag("MINILISP_DEBUG_GC");
-  always_gc = getEnvFlag("MINILISP_ALWAYS_GC");
-  debug_gc=false;
-  always_gc=true;
-  /* printf("debug_gc=%d\n",debug_gc); */
-  /* printf("always_gc=%d\n",always_gc); */
+// (%bind-stack <params> (expr ...) expr ...) is %bind with the frame on the root stack, used if
+// the body creates no closure.
+static Obj *prim_bind_stack(Obj **env, Obj **list) {
+  DEFINE4(params, args, newenv, body);
+  *params = (*list)->car;
+  *args = (*list)->cdr->car;
+  *args = eval_list(env, args);
+  *body = (*list)->cdr->cdr;
+  {
+    int size = stack_env_size(*params);
+    ADD_ROOT(size);
+    *newenv = push_stack_env(root_sp - size, env, params, args);
+    return progn(newenv, body);
+  }
+}
 
-  // Memory allocation
-  memory = alloc_semispace();
+// (%closure <function>) makes a closure in the current environment from a function the optimizer
+// made for a lambda form. The function has the original body of the lambda and the optimized one.
+static Obj *prim_closure(Obj **env, Obj **list) {
+  DEFINE3(proto, params, body);
+  *proto = (*list)->car;
+  *params = (*proto)->params;
+  *body = (*proto)->body;
+  Obj *r = make_function(env, TFUNCTION, params, body);
+  r->opt = (*proto)->opt;
+  r->epoch = (*proto)->epoch;
+  r->noescape = (*proto)->noescape;
+  return r;
+}
 
-  // Constants and primitives
-  Symbols = Nil;
-  void *root = NULL;
-  DEFINE2(env, expr);
-  *env = make_env(root, &Nil, &Nil);
-  // these objects will be nerver gc-ed.
-  define_constants(root, env);
-  define_primitives(root, env);
+// The primitives above. They are not allocated in a heap, like the constants.
+static Obj internal_primitives[] __attribute((aligned(OBJ_ALIGN))) = {
+  { .type = TPRIMITIVE, .fn = prim_bind }, { .type = TPRIMITIVE, .fn = prim_bind_stack },
+  { .type = TPRIMITIVE, .fn = prim_progn }, { .type = TPRIMITIVE, .fn = prim_closure } };
+static Obj *Bind = &internal_primitives[0];
+static Obj *BindStack = &internal_primitives[1];
+static Obj *Progn = &internal_primitives[2];
+static Obj *Closure = &internal_primitives[3];
 
-  // The main loop
-  for (;;) {
-    *expr = read_expr(root);
-    if (!*expr)
-      return 0;
-    if (*expr == Cparen)
-      error("Stray close parenthesis");
-    if (*expr == Dot)
-      error("Stray dot");
-    print(eval(root, env, expr));
-    printf("\n");
+// The largest function body to inline, in cells, and how deep inlined functions may nest
+#define INLINE_SIZE 16
+#define INLINE_DEPTH 3
+
+// The number of forms the optimizer may visit for a function. This stops a macro that expands
+// into itself forever.
+#define OPTIMIZE_FUEL 10000
+
+typedef struct {
+  Obj **genv;    // the global environment frame
+  Obj **scopes;  // the parameter lists of the lambdas in scope
+  int depth;     // the number of inlined functions the current form is in
+  int fuel;
+  int epoch;     // the epoch of the definitions the optimized body depends on
+} Opt;
+
+static bool is_defining(Obj *obj) {
+  for (; type_of(obj) == TCELL; obj = obj->cdr) {
+    Obj *head = obj->car;
+    if (type_of(head) == TSYMBOL &&
+        (!strcmp(head->name, "define") || !strcmp(head->name, "defun") ||
+         !strcmp(head->name, "defmacro")))
+      return true;
+    if (is_defining(head))
+      return true;
+  }
+  return false;
+}
+
+// True if the symbol is in one of the parameter lists.
+static bool in_scopes(Obj *scopes, Obj *sym) {
+  for (; scopes != Nil; scopes = scopes->cdr) {
+    Obj *p = scopes->car;
+    for (; type_of(p) == TCELL; p = p->cdr)
+      if (p->car == sym)
+        return true;
+    if (p == sym)
+      return true;
+  }
+  return false;
+}
+
+static bool is_lambda_list(Obj *params) {
+  for (; type_of(params) == TCELL; params = params->cdr)
+    if (type_of(params->car) != TSYMBOL)
+      return false;
+  return params == Nil || type_of(params) == TSYMBOL;
+}
+
+static int tree_size(Obj *obj) {
+  int n = 0;
+  for (; type_of(obj) == TCELL; obj = obj->cdr)
+    n += 1 + tree_size(obj->car);
+  return n;
+}
+
+// True if the tree contains the symbol, or a symbol that is local in the optimizer's scope.
+static bool mentions(Opt *o, Obj *obj, Obj *sym) {
+  if (type_of(obj) == TSYMBOL)
+    return obj == sym || in_scopes(*o->scopes, obj);
+  for (; type_of(obj) == TCELL; obj = obj->cdr)
+    if (mentions(o, obj->car, sym))
+      return true;
+  return false;
+}
+
+static bool creates_closure(Obj *body);
+
+// True if evaluating any of the unquoted expressions in the quasiquote template may create a
+// closure.
+static bool template_creates_closure(Obj *tmpl, int depth) {
+  if (type_of(tmpl) != TCELL)
+    return false;
+  int kind = quote_kind(tmpl);
+  if (kind == QUASIQUOTE || (kind && depth > 0))
+    return template_creates_closure(tmpl->cdr->car, kind == QUASIQUOTE ? depth + 1 : depth - 1);
+  if (kind)
+    return creates_closure(tmpl->cdr);
+  return template_creates_closure(tmpl->car, depth) || template_creates_closure(tmpl->cdr, depth);
+}
+
+// True if evaluating any of the forms may create a closure, which may keep the environment alive
+// after the forms are evaluated. The forms are assumed to be safe only if the heads of all forms
+// are primitives or functions themselves, as in an optimized body, since a symbol may be bound to
+// a macro or to lambda by the time the form is evaluated.
+static bool creates_closure(Obj *body) {
+  for (; type_of(body) == TCELL; body = body->cdr) {
+    Obj *form = body->car;
+    if (type_of(form) != TCELL)
+      continue;
+    Obj *head = form->car;
+    Obj *args = form->cdr;
+    if (type_of(head) == TCELL) {
+      if (creates_closure(form))
+        return true;
+      continue;
+    }
+    if (type_of(head) == TFUNCTION) {
+      if (creates_closure(args))
+        return true;
+      continue;
+    }
+    if (type_of(head) != TPRIMITIVE)
+      return true;
+    Primitive *fn = head->fn;
+    if (fn == prim_quote || fn == prim_macroexpand)
+      continue;
+    if (fn == prim_lambda || fn == prim_closure || fn == prim_defun || fn == prim_defmacro ||
+        fn == prim_define)
+      return true;
+    if (fn == prim_bind || fn == prim_bind_stack) {
+      if (length(args) < 2 || creates_closure(args->cdr->car) || creates_closure(args->cdr->cdr))
+        return true;
+      continue;
+    }
+    if (fn == prim_quasiquote) {
+      if (length(args) != 1 || template_creates_closure(args->car, 0))
+        return true;
+      continue;
+    }
+    if (fn == prim_cond) {
+      for (; type_of(args) == TCELL; args = args->cdr)
+        if (creates_closure(args->car))
+          return true;
+      if (args != Nil)
+        return true;
+      continue;
+    }
+    if (fn == prim_dotimes) {
+      if (length(args) < 1 || !is_dotimes_spec(args->car) || creates_closure(args->car->cdr) ||
+          creates_closure(args->cdr))
+        return true;
+      continue;
+    }
+    if (creates_closure(args))
+      return true;
+  }
+  return body != Nil;
+}
+
+// Returns the value of the optimized form if it is a constant, or NULL.
+static Obj *constant_value(Obj *form) {
+  switch (type_of(form)) {
+  case TINT:
+  case TTRUE:
+  case TNIL:
+    return form;
+  case TCELL:
+    if (type_of(form->car) == TPRIMITIVE && form->car->fn == prim_quote &&
+        type_of(form->cdr) == TCELL && form->cdr->cdr == Nil)
+      return form->cdr->car;
+  }
+  return NULL;
+}
+
+static Obj *optimize(Opt *o, Obj **form);
+
+static Obj *optimize_list(Opt *o, Obj **list) {
+  DEFINE3(lp, expr, head);
+  *head = Nil;
+  for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+    *expr = (*lp)->car;
+    *expr = optimize(o, expr);
+    *head = cons(expr, head);
+  }
+  return reverse(*head);
+}
+
+// Optimizes the unquoted expressions in the quasiquote template.
+static Obj *optimize_template(Opt *o, Obj **tmpl, int depth) {
+  if (type_of(*tmpl) != TCELL)
+    return *tmpl;
+  DEFINE2(head, tail);
+  int kind = quote_kind(*tmpl);
+  if (kind) {
+    *head = (*tmpl)->cdr->car;
+    if (kind == QUASIQUOTE || depth > 0)
+      *head = optimize_template(o, head, kind == QUASIQUOTE ? depth + 1 : depth - 1);
+    else
+      *head = optimize(o, head);
+    return requote(tmpl, head);
+  }
+  *head = (*tmpl)->car;
+  *head = optimize_template(o, head, depth);
+  *tail = (*tmpl)->cdr;
+  *tail = optimize_template(o, tail, depth);
+  if (*head == (*tmpl)->car && *tail == (*tmpl)->cdr)
+    return *tmpl;
+  return cons(head, tail);
+}
+
+// Optimizes the body of a lambda with the given parameters.
+static Obj *optimize_body(Opt *o, Obj **params, Obj **body) {
+  DEFINE1(scopes);
+  Obj **saved = o->scopes;
+  *scopes = cons(params, o->scopes);
+  o->scopes = scopes;
+  Obj *r = optimize_list(o, body);
+  o->scopes = saved;
+  return r;
+}
+
+// Returns a form that evaluates the body with the parameters bound to the values of the
+// optimized arguments.
+static Obj *make_binding(Obj **params, Obj **args, Obj **body) {
+  DEFINE1(tmp);
+  if (*params != Nil || *args != Nil) {
+    *tmp = cons(args, body);
+    *tmp = cons(params, tmp);
+    return cons(creates_closure(*body) ? &Bind : &BindStack, tmp);
+  }
+  if ((*body)->cdr == Nil)
+    return (*body)->car;
+  return cons(&Progn, body);
+}
+
+// Optimizes the application of a primitive. Returns NULL to leave the form as it is.
+static Obj *optimize_primitive(Opt *o, Obj **prim, Obj **args) {
+  Primitive *fn = (*prim)->fn;
+  int n = length(*args);
+  DEFINE4(params, vals, body, tmp);
+  if (fn == prim_define || fn == prim_defun || fn == prim_defmacro)
+    error("optimize: definition");
+  if (fn == prim_quote)
+    return cons(prim, args);
+  if (fn == prim_quasiquote) {
+    if (n != 1)
+      return NULL;
+    *body = (*args)->car;
+    *body = optimize_template(o, body, 0);
+    *tmp = cons(body, &Nil);
+    return cons(prim, tmp);
+  }
+  if (fn == prim_lambda) {
+    if (n < 2 || !is_list((*args)->car) || !is_lambda_list((*args)->car))
+      return NULL;
+    *params = (*args)->car;
+    *body = (*args)->cdr;
+    *tmp = optimize_body(o, params, body);
+    int noescape = (creates_closure(*body) ? 0 : NOESCAPE_BODY) |
+                   (creates_closure(*tmp) ? 0 : NOESCAPE_OPT);
+    *vals = make_function(&Nil, TFUNCTION, params, body);
+    (*vals)->opt = *tmp;
+    (*vals)->epoch = o->epoch;
+    (*vals)->noescape = noescape;
+    *tmp = cons(vals, &Nil);
+    return cons(&Closure, tmp);
+  }
+  if (fn == prim_setq) {
+    if (n != 2 || type_of((*args)->car) != TSYMBOL)
+      return NULL;
+    *vals = (*args)->cdr;
+    *vals = optimize_list(o, vals);
+    *params = (*args)->car;
+    *tmp = cons(params, vals);
+    return cons(prim, tmp);
+  }
+  if (fn == prim_if) {
+    if (n < 2)
+      return NULL;
+    *vals = optimize_list(o, args);
+    Obj *cond = constant_value((*vals)->car);
+    if (!cond)
+      return cons(prim, vals);
+    if (cond != Nil)
+      return (*vals)->cdr->car;
+    *body = (*vals)->cdr->cdr;
+    return *body == Nil ? Nil : make_binding(&Nil, &Nil, body);
+  }
+  if (fn == prim_progn) {
+    if (n < 0)
+      return NULL;
+    *body = optimize_list(o, args);
+    return *body == Nil ? Nil : make_binding(&Nil, &Nil, body);
+  }
+  if (fn == prim_let) {
+    if (n < 2 || !is_let_bindings((*args)->car))
+      return NULL;
+    *params = *vals = Nil;
+    for (*tmp = (*args)->car; *tmp != Nil; *tmp = (*tmp)->cdr) {
+      *body = (*tmp)->car->cdr->car;
+      *body = optimize(o, body);
+      *vals = cons(body, vals);
+      *body = (*tmp)->car->car;
+      *params = cons(body, params);
+    }
+    *params = reverse(*params);
+    *vals = reverse(*vals);
+    *body = (*args)->cdr;
+    *body = optimize_body(o, params, body);
+    return make_binding(params, vals, body);
+  }
+  if (fn == prim_cond) {
+    if (n < 0)
+      return NULL;
+    for (Obj *p = *args; p != Nil; p = p->cdr)
+      if (length(p->car) < 1)
+        return NULL;
+    *vals = Nil;
+    for (*tmp = *args; *tmp != Nil; *tmp = (*tmp)->cdr) {
+      *body = (*tmp)->car;
+      *body = optimize_list(o, body);
+      *vals = cons(body, vals);
+    }
+    *vals = reverse(*vals);
+    return cons(prim, vals);
+  }
+  if (fn == prim_dotimes) {
+    if (n < 1 || !is_dotimes_spec((*args)->car))
+      return NULL;
+    // The count is evaluated outside of the scope of the variable, and the result inside
+    *params = (*args)->car->car;
+    *params = cons(params, &Nil);
+    *tmp = (*args)->car->cdr->cdr;
+    *tmp = optimize_body(o, params, tmp);
+    *vals = (*args)->car->cdr->car;
+    *vals = optimize(o, vals);
+    *tmp = cons(vals, tmp);
+    *vals = (*args)->car->car;
+    *tmp = cons(vals, tmp);
+    *body = (*args)->cdr;
+    *body = optimize_body(o, params, body);
+    *tmp = cons(tmp, body);
+    return cons(prim, tmp);
+  }
+  if (fn == prim_plus || fn == prim_minus || fn == prim_lt || fn == prim_num_eq) {
+    *vals = optimize_list(o, args);
+    bool literals = 1 <= n && (fn == prim_plus || fn == prim_minus || n == 2);
+    for (Obj *p = *vals; p != Nil; p = p->cdr)
+      literals = literals && type_of(p->car) == TINT;
+    return literals ? fn(o->genv, vals) : cons(prim, vals);
+  }
+  if (fn == prim_cons || fn == prim_car || fn == prim_cdr || fn == prim_setcar ||
+      fn == prim_while || fn == prim_gensym || fn == prim_eq || fn == prim_println ||
+      fn == prim_pmap || fn == prim_and || fn == prim_or) {
+    *vals = optimize_list(o, args);
+    return cons(prim, vals);
+  }
+  return NULL;
+}
+
+// Optimizes a call of a global function, inlining it if it is small and does not call itself.
+// Nothing is inlined while the calls are counted by the limits or the profiler.
+static Obj *optimize_call(Opt *o, Obj **sym, Obj **fn, Obj **args) {
+  DEFINE3(params, vals, body);
+  *vals = optimize_list(o, args);
+  if (fuel_limit || depth_limit != INT_MAX || prof_stack)
+    return cons(fn, vals);
+  if ((*fn)->env != *o->genv || o->depth == INLINE_DEPTH || INLINE_SIZE < tree_size((*fn)->body) ||
+      mentions(o, (*fn)->body, *sym) || is_defining((*fn)->body))
+    return cons(fn, vals);
+  *params = (*fn)->params;
+  *body = (*fn)->body;
+  o->depth++;
+  *body = optimize_body(o, params, body);
+  o->depth--;
+  return make_binding(params, vals, body);
+}
+
+static Obj *optimize(Opt *o, Obj **form) {
+  DEFINE4(expr, head, args, value);
+  // Macros are expanded in this loop rather than by recursion, as a macro may expand into a use
+  // of itself any number of times.
+  for (*expr = *form;; *expr = *value) {
+    if (--o->fuel < 0)
+      error("optimize: too large");
+    if (type_of(*expr) != TCELL || length(*expr) < 0)
+      return *expr;
+    *head = (*expr)->car;
+    *args = (*expr)->cdr;
+
+    // ((lambda <params> expr ...) expr ...)
+    if (type_of(*head) == TCELL && type_of((*head)->car) == TSYMBOL &&
+        !in_scopes(*o->scopes, (*head)->car) && length(*head) >= 3 &&
+        is_list((*head)->cdr->car) && is_lambda_list((*head)->cdr->car)) {
+      Obj *bind = find(o->genv, (*head)->car);
+      if (bind && type_of(bind->cdr) == TPRIMITIVE && bind->cdr->fn == prim_lambda) {
+        DEFINE2(params, body);
+        *args = optimize_list(o, args);
+        *params = (*head)->cdr->car;
+        *body = (*head)->cdr->cdr;
+        *body = optimize_body(o, params, body);
+        return make_binding(params, args, body);
+      }
+    }
+
+    if (type_of(*head) == TSYMBOL && !in_scopes(*o->scopes, *head)) {
+      Obj *bind = find(o->genv, *head);
+      *value = bind ? bind->cdr : Nil;
+      if (type_of(*value) == TMACRO) {
+        *value = expand_early(o->genv, value, args);
+        if (!*value)
+          return *expr;
+        continue;
+      }
+      if (type_of(*value) == TPRIMITIVE) {
+        *value = optimize_primitive(o, value, args);
+        return *value ? *value : *expr;
+      }
+      if (type_of(*value) == TFUNCTION)
+        return optimize_call(o, head, value, args);
+    }
+
+    // A call of a local function or of the value of an expression
+    *head = optimize(o, head);
+    *args = optimize_list(o, args);
+    return cons(head, args);
+  }
+}
+
+// Returns the body of the function to evaluate. The optimized body is made on the first call,
+// and again after a definition has changed.
+static Obj *optimized_body(Obj **fn) {
+  if ((*fn)->opt != Nil && (*fn)->epoch == defs_epoch)
+    return (*fn)->opt;
+  if (in_pmap_worker || (*fn)->env->up != Nil)
+    return (*fn)->body;
+
+  // The original body is used while the function is being optimized, as a macro used in the
+  // body may call the function. A function whose body cannot be expanded, for example because
+  // a macro fails, is not optimized.
+  int epoch = defs_epoch;
+  write_barrier(*fn);
+  (*fn)->opt = (*fn)->body;
+  (*fn)->epoch = epoch;
+  if (is_defining((*fn)->body))
+    return (*fn)->body;
+
+  DEFINE4(genv, scopes, body, opt);
+  Opt o = { genv, scopes, 0, OPTIMIZE_FUEL, epoch };
+  *genv = (*fn)->env;
+  *scopes = (*fn)->params;
+  *scopes = cons(scopes, &Nil);
+  *body = (*fn)->body;
+  jmp_buf jb;
+  jmp_buf *saved_handler = error_handler;
+  Obj **sp = root_sp;
+  int saved_depth = depth;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    *opt = optimize_list(&o, body);
+  } else {
+    root_sp = sp;
+    depth = saved_depth;
+    *opt = (*fn)->body;
   }
+  error_handler = saved_handler;
+  write_barrier(*fn);
+  (*fn)->opt = *opt;
+  if (creates_closure(*opt))
+    (*fn)->noescape &= ~NOESCAPE_OPT;
+  else
+    (*fn)->noescape |= NOESCAPE_OPT;
+  return *opt;
+}
+
+//======================================================================
+// JIT compiler
+//
+// With MINILISP_JIT=N, a function defined by defun at the top level is compiled to x86-64 machine
+// code once it has been called N times. This is a baseline compiler: each form is translated to a
+// fixed instruction sequence, with fast paths for the common primitives and calls into the
+// runtime for everything else.
+//
+// The compiled code follows the same rules as the C code for GC safety. It never keeps a pointer
+// to a Lisp object in a register across a call into the runtime, which is the only place GC can
+// happen. Temporaries are kept in slots on the root stack, and the objects the code refers to are
+// kept in a constant table per function that GC treats as a root. Register usage:
+//
+//   rbx  the environment the function was called with (Obj **)
+//   r12  the function's slots on the root stack
+//   r13  the constant table
+//
+// The compiler resolves names when it compiles, assuming that a global binding it sees then does
+// not change. Macros are expanded at compile time, and the primitives and functions are called
+// directly. Each such decision is guarded by a check of the binding at runtime, and the form is
+// evaluated by the interpreter if the check fails. Functions that may add local variables with
+// define are not compiled.
+//
+// The compiler runs only on the main thread of the interactive mode, and only on x86-64.
+//======================================================================
+
+// A function that is a candidate for compilation
+typedef struct {
+  int calls;
+  bool compiling;
+  bool failed;
+  JitCode *code;
+  // The objects the code refers to
+  Obj **consts;
+  int nconsts;
+  int consts_cap;
+  // The parameter lists of the compiled lambdas the function is nested in
+  Obj *scopes;
+} JitFunc;
+
+static JitFunc **jit_funcs;
+static int njit_funcs = 1;  // 0 means "not a candidate"
+static int jit_threshold;
+
+// The constants of a program compiled by --compile-c, followed by as many slots caching the global
+// bindings of the symbols among them. See the "Ahead-of-time compiler" section.
+static Obj **aot_consts;
+static int aot_nconsts;
+
+// Returns a new index for a function that may be compiled, or 0 if the table is full.
+static int jit_register(Obj *scopes) {
+  if (!jit_thread || UINT16_MAX <= njit_funcs)
+    return 0;
+  jit_funcs = realloc(jit_funcs, sizeof(JitFunc *) * (njit_funcs + 1));
+  JitFunc *f = calloc(1, sizeof(JitFunc));
+  f->scopes = scopes;
+  jit_funcs[njit_funcs] = f;
+  return njit_funcs++;
+}
+
+static void forward_jit_roots(Obj *(*fn)(Obj *)) {
+  if (!jit_thread)
+    return;
+  for (int i = 1; i < njit_funcs; i++) {
+    JitFunc *f = jit_funcs[i];
+    for (int j = 0; j < f->nconsts; j++)
+      f->consts[j] = fn(f->consts[j]);
+    f->scopes = fn(f->scopes);
+  }
+  for (int i = 0; i < aot_nconsts * 2; i++)
+    if (aot_consts[i])
+      aot_consts[i] = fn(aot_consts[i]);
+}
+
+// Runtime functions called by the compiled code
+
+static Obj **jit_enter(int nslots) {
+  if (root_limit - root_sp < nslots)
+    error("Stack overflow");
+  Obj **slots = root_sp;
+  memset(slots, 0, sizeof(Obj *) * nslots);
+  root_sp += nslots;
+  return slots;
+}
+
+static void jit_error(char *msg) {
+  error("%s", msg);
+}
+
+static Obj *jit_var(Obj **env, Obj *sym) {
+  Obj *bind = find(env, sym);
+  if (!bind)
+    error("Undefined symbol: %s", sym->name);
+  return bind->cdr;
+}
+
+static Obj *jit_eval(Obj **env, Obj *form) {
+  DEFINE1(expr);
+  *expr = form;
+  return eval(env, expr);
+}
+
+static Obj *jit_apply(Obj **fn, Obj **args) {
+  return apply_func(fn, fn, args);
+}
+
+// Calls a function that may be compiled with the n arguments in the slots starting at args. The
+// frame is made directly from the slots rather than from a list of the arguments, and the
+// function's compiled code is called without going through apply_func() and eval(). The function
+// must take exactly n parameters.
+static Obj *jit_call(Obj **fn, Obj **args, int n) {
+  enter_function(*fn);
+  DEFINE4(vars, sym, map, env);
+  *vars = (*fn)->params;
+  *map = Nil;
+  for (int i = 0; i < n; i++, *vars = (*vars)->cdr) {
+    *sym = (*vars)->car;
+    *map = acons(sym, &args[i], map);
+  }
+  *env = (*fn)->env;
+  *env = make_env(map, env);
+  JitCode *code = jit_code(fn, env);
+  Obj *r;
+  if (code) {
+    r = code(env);
+  } else {
+    DEFINE1(body);
+    *body = optimized_body(fn);
+    r = progn(env, body);
+  }
+  depth--;
+  return r;
+}
+
+static Obj *jit_push_env(Obj **env, Obj *params, Obj **args) {
+  DEFINE1(vars);
+  *vars = params;
+  return push_env(env, vars, args);
+}
+
+static Obj *jit_closure(Obj **env, Obj *params, Obj *body, int index) {
+  DEFINE2(p, b);
+  *p = params;
+  *b = body;
+  Obj *fn = make_function(env, TFUNCTION, p, b);
+  fn->jit = index;
+  return fn;
+}
+
+static Obj *jit_find(Obj **env, Obj *sym) {
+  Obj *bind = find(env, sym);
+  if (!bind)
+    error("Unbound variable %s", sym->name);
+  return bind;
+}
+
+static Obj *jit_setq(Obj **bind, Obj **value) {
+  check_writable(*bind, "setq");
+  note_binding((*bind)->cdr, *value);
+  write_barrier(*bind);
+  (*bind)->cdr = *value;
+  return *value;
+}
+
+static Obj *jit_setcar(Obj **cell, Obj **value) {
+  if (type_of(*cell) != TCELL)
+    error("Malformed setcar");
+  check_writable(*cell, "setcar");
+  write_barrier(*cell);
+  (*cell)->car = *value;
+  return *cell;
+}
+
+static Obj *jit_println(Obj *obj) {
+  check_effect("println");
+  print(obj);
+  fprintf(output, "\n");
+  return Nil;
+}
+
+// Code generation
+
+typedef struct {
+  JitFunc *func;
+  uint8_t *buf;
+  int len;
+  int cap;
+  int nslots;      // the number of slots in use at this point
+  int max_slots;
+  int env_slot;    // the slot holding the current environment, or -1 for rbx
+  Obj **scopes;    // the parameter lists of the lambdas in scope
+  Obj **genv;      // the global environment
+  int expanding;   // the number of macro expansions the current form is in
+  bool failed;
+} Jit;
+
+// How deeply macro expansions may nest in the compilers. This stops a macro that expands into a
+// use of itself forever.
+#define MAX_EXPANSION_DEPTH 1000
+
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+enum { JMP = 0, JE = 0x84, JNE = 0x85, JL = 0x8c };
+
+static void e8(Jit *j, int b) {
+  if (j->len == j->cap) {
+    j->cap = j->cap ? j->cap * 2 : 4096;
+    j->buf = realloc(j->buf, j->cap);
+  }
+  j->buf[j->len++] = b;
+}
+
+static void e32(Jit *j, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    e8(j, v >> (i * 8));
+}
+
+static void e64(Jit *j, uint64_t v) {
+  e32(j, v);
+  e32(j, v >> 32);
+}
+
+static void ebytes(Jit *j, char *s, int n) {
+  for (int i = 0; i < n; i++)
+    e8(j, (uint8_t)s[i]);
+}
+
+// mov reg, imm64
+static void e_imm(Jit *j, int reg, uint64_t v) {
+  e8(j, 0x48);
+  e8(j, 0xb8 + reg);
+  e64(j, v);
+}
+
+// mov reg, [r12 + slot * 8]
+static void e_load_slot(Jit *j, int reg, int slot) {
+  ebytes(j, "\x49\x8b", 2);
+  e8(j, 0x84 | reg << 3);
+  e8(j, 0x24);
+  e32(j, slot * sizeof(Obj *));
+}
+
+// mov [r12 + slot * 8], rax
+static void e_store_slot(Jit *j, int slot) {
+  ebytes(j, "\x49\x89\x84\x24", 4);
+  e32(j, slot * sizeof(Obj *));
+}
+
+// lea reg, [r12 + slot * 8]
+static void e_slot_addr(Jit *j, int reg, int slot) {
+  ebytes(j, "\x49\x8d", 2);
+  e8(j, 0x84 | reg << 3);
+  e8(j, 0x24);
+  e32(j, slot * sizeof(Obj *));
+}
+
+// mov reg, [r13 + index * 8]
+static void e_load_const(Jit *j, int reg, int index) {
+  ebytes(j, "\x49\x8b", 2);
+  e8(j, 0x85 | reg << 3);
+  e32(j, index * sizeof(Obj *));
+}
+
+// Loads the pointer to the current environment to the register.
+static void e_env(Jit *j, int reg) {
+  if (j->env_slot < 0) {
+    // mov reg, rbx
+    e8(j, 0x48);
+    e8(j, 0x89);
+    e8(j, 0xd8 | reg);
+  } else {
+    e_slot_addr(j, reg, j->env_slot);
+  }
+}
+
+static void e_call(Jit *j, void *fn) {
+  e_imm(j, RAX, (uintptr_t)fn);
+  ebytes(j, "\xff\xd0", 2);
+}
+
+// Emits a jump with a placeholder offset, and returns the position of the offset.
+static int e_jump(Jit *j, int op) {
+  if (op == JMP) {
+    e8(j, 0xe9);
+  } else {
+    e8(j, 0x0f);
+    e8(j, op);
+  }
+  e32(j, 0);
+  return j->len - 4;
+}
+
+// Makes the jump at the given position jump to the current position.
+static void e_patch(Jit *j, int at) {
+  int32_t rel = j->len - (at + 4);
+  memcpy(j->buf + at, &rel, 4);
+}
+
+static void e_jump_to(Jit *j, int op, int target) {
+  int at = e_jump(j, op);
+  int32_t rel = target - (at + 4);
+  memcpy(j->buf + at, &rel, 4);
+}
+
+// Emits code that raises an error with the given message, with a jump over it. Returns the
+// position of the code.
+static int e_error_stub(Jit *j, char *msg) {
+  int skip = e_jump(j, JMP);
+  int label = j->len;
+  e_imm(j, RDI, (uintptr_t)msg);
+  e_call(j, jit_error);
+  e_patch(j, skip);
+  return label;
+}
+
+// Loads rax's integer value to ecx, or jumps to the error stub if rax is not an integer.
+static void e_int_value(Jit *j, int error_stub) {
+  ebytes(j, "\xa8", 1);                          // test al, CELL_OFFSET
+  e8(j, CELL_OFFSET);
+  e_jump_to(j, JNE, error_stub);
+  ebytes(j, "\x80\x38", 2);                      // cmp byte [rax], TINT
+  e8(j, TINT);
+  e_jump_to(j, JNE, error_stub);
+  ebytes(j, "\x8b\x48", 2);                      // mov ecx, [rax + value]
+  e8(j, offsetof(Obj, value));
+}
+
+// Sets rax to True if the last comparison satisfied the condition, or to Nil otherwise.
+static void e_bool(Jit *j, int op) {
+  e_imm(j, RAX, (uintptr_t)True);
+  e8(j, op - 0x10);                              // short jcc over the next instruction
+  e8(j, 10);
+  e_imm(j, RAX, (uintptr_t)Nil);
+}
+
+// Returns the index of the object in the constant table, adding it if needed.
+static int jit_const(Jit *j, Obj *obj) {
+  JitFunc *f = j->func;
+  for (int i = 0; i < f->nconsts; i++)
+    if (f->consts[i] == obj)
+      return i;
+  if (f->nconsts == f->consts_cap) {
+    f->consts_cap = f->consts_cap ? f->consts_cap * 2 : 16;
+    f->consts = realloc(f->consts, sizeof(Obj *) * f->consts_cap);
+  }
+  f->consts[f->nconsts] = obj;
+  return f->nconsts++;
+}
+
+static int new_slot(Jit *j) {
+  if (j->max_slots < ++j->nslots)
+    j->max_slots = j->nslots;
+  return j->nslots - 1;
+}
+
+// True if the symbol is a parameter of a lambda in scope.
+static bool is_local(Jit *j, Obj *sym) {
+  return in_scopes(*j->scopes, sym);
+}
+
+// Returns the global binding of the symbol, or NULL if it's not global.
+static Obj *global_bind(Jit *j, Obj *sym) {
+  return is_local(j, sym) ? NULL : find(j->genv, sym);
+}
+
+static void compile_expr(Jit *j, Obj **expr);
+
+static void compile_body(Jit *j, Obj **body) {
+  DEFINE1(lp);
+  for (*lp = *body; *lp != Nil; *lp = (*lp)->cdr) {
+    DEFINE1(expr);
+    *expr = (*lp)->car;
+    compile_expr(j, expr);
+  }
+}
+
+// Evaluates the form in the interpreter.
+static void compile_generic(Jit *j, Obj **form) {
+  if (is_defining(*form))
+    j->failed = true;
+  e_env(j, RDI);
+  e_load_const(j, RSI, jit_const(j, *form));
+  e_call(j, jit_eval);
+}
+
+// Evaluates the elements of the list to new slots. Returns the first slot.
+static int compile_args(Jit *j, Obj **list) {
+  int first = j->nslots;
+  DEFINE1(lp);
+  for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+    DEFINE1(expr);
+    *expr = (*lp)->car;
+    compile_expr(j, expr);
+    e_store_slot(j, new_slot(j));
+  }
+  return first;
+}
+
+// Conses up the values in the n slots starting at first into a list in a new slot.
+static int compile_list(Jit *j, int first, int n) {
+  int list = new_slot(j);
+  e_imm(j, RAX, (uintptr_t)Nil);
+  e_store_slot(j, list);
+  for (int i = first + n - 1; first <= i; i--) {
+    e_slot_addr(j, RDI, i);
+    e_slot_addr(j, RSI, list);
+    e_call(j, cons);
+    e_store_slot(j, list);
+  }
+  return list;
+}
+
+// True if the function can be called by jit_call() with n arguments.
+static bool is_direct_callee(Obj *fn, int n) {
+  if (!fn->jit)
+    return false;
+  Obj *p = fn->params;
+  for (; type_of(p) == TCELL; p = p->cdr)
+    n--;
+  return p == Nil && n == 0;
+}
+
+// Calls the function in the slot with the arguments of the form. If the function is the known
+// one, which the compiler saw bound to the head of the form, the arguments are passed to it in
+// their slots. Any other function is called with a list of the arguments.
+static void compile_call(Jit *j, int fn, Obj **args, Obj *known) {
+  int n = length(*args);
+  // The constant table keeps the function alive while the arguments are compiled.
+  int direct = known && is_direct_callee(known, n) ? jit_const(j, known) : -1;
+  int first = compile_args(j, args);
+  int end = -1;
+  if (0 <= direct) {
+    e_load_slot(j, RAX, fn);
+    e_load_const(j, RCX, direct);
+    ebytes(j, "\x48\x39\xc8", 3);                // cmp rax, rcx
+    int other = e_jump(j, JNE);
+    e_slot_addr(j, RDI, fn);
+    e_slot_addr(j, RSI, first);
+    e8(j, 0xba);                                 // mov edx, imm32
+    e32(j, n);
+    e_call(j, jit_call);
+    end = e_jump(j, JMP);
+    e_patch(j, other);
+  }
+  int list = compile_list(j, first, n);
+  e_slot_addr(j, RDI, fn);
+  e_slot_addr(j, RSI, list);
+  e_call(j, jit_apply);
+  if (0 <= end)
+    e_patch(j, end);
+}
+
+// Jumps to the returned position unless rax is a function.
+static int e_check_function(Jit *j) {
+  ebytes(j, "\xa8", 1);                          // test al, CELL_OFFSET
+  e8(j, CELL_OFFSET);
+  int cell = e_jump(j, JNE);
+  ebytes(j, "\x80\x38", 2);                      // cmp byte [rax], TFUNCTION
+  e8(j, TFUNCTION);
+  int ok = e_jump(j, JE);
+  e_patch(j, cell);
+  int fail = e_jump(j, JMP);
+  e_patch(j, ok);
+  return fail;
+}
+
+// Evaluates the body with the parameters bound to the values of the arguments.
+static void compile_binding(Jit *j, Obj **params, Obj **args, Obj **body) {
+  DEFINE1(saved_scopes);
+  int n = length(*args);
+  int first = compile_args(j, args);
+  if (*params == Nil && n == 0) {
+    // The frame would be empty.
+    compile_body(j, body);
+    return;
+  }
+  int list = compile_list(j, first, n);
+  e_env(j, RDI);
+  e_load_const(j, RSI, jit_const(j, *params));
+  e_slot_addr(j, RDX, list);
+  e_call(j, jit_push_env);
+  int env = new_slot(j);
+  e_store_slot(j, env);
+
+  int saved_env = j->env_slot;
+  *saved_scopes = *j->scopes;
+  *j->scopes = cons(params, j->scopes);
+  j->env_slot = env;
+  compile_body(j, body);
+  j->env_slot = saved_env;
+  *j->scopes = *saved_scopes;
+}
+
+// ((lambda (<symbol> ...) expr ...) expr ...)
+static void compile_lambda_call(Jit *j, Obj **form) {
+  DEFINE3(params, body, args);
+  *params = (*form)->car->cdr->car;
+  *body = (*form)->car->cdr->cdr;
+  *args = (*form)->cdr;
+  compile_binding(j, params, args, body);
+}
+
+// Jumps to the returned position if rax is (), or unless it is () if the op is JNE.
+static int e_jump_nil(Jit *j, int op) {
+  e_imm(j, RCX, (uintptr_t)Nil);
+  ebytes(j, "\x48\x39\xc8", 3);                  // cmp rax, rcx
+  return e_jump(j, op);
+}
+
+// Compiles the application of a primitive. Returns false if it's not one the compiler knows.
+static bool compile_primitive(Jit *j, Obj **form, Primitive *prim) {
+  DEFINE2(args, expr);
+  *args = (*form)->cdr;
+  int n = length(*args);
+
+  if (prim == prim_quote && n == 1) {
+    e_load_const(j, RAX, jit_const(j, (*args)->car));
+    return true;
+  }
+
+  if (prim == prim_if && 2 <= n) {
+    *expr = (*args)->car;
+    compile_expr(j, expr);
+    e_imm(j, RCX, (uintptr_t)Nil);
+    ebytes(j, "\x48\x39\xc8", 3);                // cmp rax, rcx
+    int els = e_jump(j, JE);
+    *expr = (*args)->cdr->car;
+    compile_expr(j, expr);
+    int end = e_jump(j, JMP);
+    e_patch(j, els);
+    *expr = (*args)->cdr->cdr;
+    if (*expr == Nil)
+      e_imm(j, RAX, (uintptr_t)Nil);
+    else
+      compile_body(j, expr);
+    e_patch(j, end);
+    return true;
+  }
+
+  if (prim == prim_progn) {
+    if (n == 0)
+      e_imm(j, RAX, (uintptr_t)Nil);
+    else
+      compile_body(j, args);
+    return true;
+  }
+
+  if (prim == prim_and || prim == prim_or) {
+    if (n == 0) {
+      e_imm(j, RAX, (uintptr_t)(prim == prim_and ? True : Nil));
+      return true;
+    }
+    // Every expression but the last one jumps to the end if it decides the value.
+    int ends[n];
+    int i = 0;
+    for (*expr = *args; *expr != Nil; *expr = (*expr)->cdr) {
+      DEFINE1(arg);
+      *arg = (*expr)->car;
+      compile_expr(j, arg);
+      if ((*expr)->cdr != Nil)
+        ends[i++] = e_jump_nil(j, prim == prim_and ? JE : JNE);
+    }
+    while (i > 0)
+      e_patch(j, ends[--i]);
+    return true;
+  }
+
+  if (prim == prim_cond) {
+    for (Obj *p = *args; p != Nil; p = p->cdr)
+      if (length(p->car) < 1)
+        return false;
+    int ends[n + 1];
+    int i = 0;
+    for (*expr = *args; *expr != Nil; *expr = (*expr)->cdr) {
+      DEFINE1(clause);
+      *clause = (*expr)->car->car;
+      compile_expr(j, clause);
+      *clause = (*expr)->car->cdr;
+      if (*clause == Nil) {
+        // The value of the test is the value of the clause.
+        ends[i++] = e_jump_nil(j, JNE);
+        continue;
+      }
+      int next = e_jump_nil(j, JE);
+      compile_body(j, clause);
+      ends[i++] = e_jump(j, JMP);
+      e_patch(j, next);
+    }
+    e_imm(j, RAX, (uintptr_t)Nil);
+    while (i > 0)
+      e_patch(j, ends[--i]);
+    return true;
+  }
+
+  if (prim == prim_let && 2 <= n && is_let_bindings((*args)->car)) {
+    DEFINE3(params, vals, tmp);
+    *params = *vals = Nil;
+    for (*expr = (*args)->car; *expr != Nil; *expr = (*expr)->cdr) {
+      *tmp = (*expr)->car->car;
+      *params = cons(tmp, params);
+      *tmp = (*expr)->car->cdr->car;
+      *vals = cons(tmp, vals);
+    }
+    *params = reverse(*params);
+    *vals = reverse(*vals);
+    *expr = (*args)->cdr;
+    compile_binding(j, params, vals, expr);
+    return true;
+  }
+
+  if (prim == prim_dotimes && 1 <= n && is_dotimes_spec((*args)->car)) {
+    *expr = (*args)->car->cdr->car;
+    compile_expr(j, expr);
+    int count = new_slot(j);
+    e_store_slot(j, count);
+    e_env(j, RDI);
+    e_load_const(j, RSI, jit_const(j, (*args)->car->car));
+    e_load_slot(j, RDX, count);
+    e_call(j, dotimes_env);
+    int frame = new_slot(j);
+    e_store_slot(j, frame);
+
+    DEFINE2(params, saved_scopes);
+    int saved_env = j->env_slot;
+    *params = (*args)->car->car;
+    *params = cons(params, &Nil);
+    *saved_scopes = *j->scopes;
+    *j->scopes = cons(params, j->scopes);
+    j->env_slot = frame;
+    int top = j->len;
+    e_slot_addr(j, RDI, frame);
+    e_load_slot(j, RSI, count);
+    e_call(j, dotimes_test);
+    int end = e_jump_nil(j, JE);
+    *expr = (*args)->cdr;
+    compile_body(j, expr);
+    e_slot_addr(j, RDI, frame);
+    e_call(j, dotimes_next);
+    e_jump_to(j, JMP, top);
+    e_patch(j, end);
+    *expr = (*args)->car->cdr->cdr;
+    if (*expr == Nil)
+      e_imm(j, RAX, (uintptr_t)Nil);
+    else
+      compile_body(j, expr);
+    j->env_slot = saved_env;
+    *j->scopes = *saved_scopes;
+    return true;
+  }
+
+  if (prim == prim_while && 2 <= n) {
+    int top = j->len;
+    if (fuel_limit || prof_stack)
+      e_call(j, safepoint);
+    *expr = (*args)->car;
+    compile_expr(j, expr);
+    e_imm(j, RCX, (uintptr_t)Nil);
+    ebytes(j, "\x48\x39\xc8", 3);                // cmp rax, rcx
+    int end = e_jump(j, JE);
+    *expr = (*args)->cdr;
+    compile_body(j, expr);
+    e_jump_to(j, JMP, top);
+    e_patch(j, end);
+    e_imm(j, RAX, (uintptr_t)Nil);
+    return true;
+  }
+
+  if (prim == prim_setq && n == 2 && type_of((*args)->car) == TSYMBOL) {
+    e_env(j, RDI);
+    e_load_const(j, RSI, jit_const(j, (*args)->car));
+    e_call(j, jit_find);
+    int bind = new_slot(j);
+    e_store_slot(j, bind);
+    *expr = (*args)->cdr->car;
+    compile_expr(j, expr);
+    int value = new_slot(j);
+    e_store_slot(j, value);
+    e_slot_addr(j, RDI, bind);
+    e_slot_addr(j, RSI, value);
+    e_call(j, jit_setq);
+    return true;
+  }
+
+  if (prim == prim_lambda && 2 <= n && is_lambda_list((*args)->car)) {
+    int index = jit_register(*j->scopes);
+    e_env(j, RDI);
+    e_load_const(j, RSI, jit_const(j, (*args)->car));
+    e_load_const(j, RDX, jit_const(j, (*args)->cdr));
+    e8(j, 0xb9);                                 // mov ecx, imm32
+    e32(j, index);
+    e_call(j, jit_closure);
+    return true;
+  }
+
+  if ((prim == prim_plus) || (prim == prim_minus && 1 <= n)) {
+    char *msg = prim == prim_plus ? "+ takes only numbers" : "- takes only numbers";
+    int first = compile_args(j, args);
+    int error_stub = e_error_stub(j, msg);
+    ebytes(j, "\x31\xd2", 2);                    // xor edx, edx
+    for (int i = 0; i < n; i++) {
+      e_load_slot(j, RAX, first + i);
+      e_int_value(j, error_stub);
+      if (prim == prim_minus && i == 0)
+        ebytes(j, "\x89\xca", 2);                // mov edx, ecx
+      else if (prim == prim_minus)
+        ebytes(j, "\x29\xca", 2);                // sub edx, ecx
+      else
+        ebytes(j, "\x01\xca", 2);                // add edx, ecx
+    }
+    if (prim == prim_minus && n == 1)
+      ebytes(j, "\xf7\xda", 2);                  // neg edx
+    ebytes(j, "\x89\xd7", 2);                    // mov edi, edx
+    e_call(j, make_int);
+    return true;
+  }
+
+  if ((prim == prim_lt || prim == prim_num_eq) && n == 2) {
+    int first = compile_args(j, args);
+    int error_stub = e_error_stub(j, prim == prim_lt ? "< takes only numbers" : "= only takes numbers");
+    e_load_slot(j, RAX, first);
+    e_int_value(j, error_stub);
+    ebytes(j, "\x89\xca", 2);                    // mov edx, ecx
+    e_load_slot(j, RAX, first + 1);
+    e_int_value(j, error_stub);
+    ebytes(j, "\x39\xca", 2);                    // cmp edx, ecx
+    e_bool(j, prim == prim_lt ? JL : JE);
+    return true;
+  }
+
+  if (prim == prim_eq && n == 2) {
+    int first = compile_args(j, args);
+    e_load_slot(j, RAX, first);
+    e_load_slot(j, RCX, first + 1);
+    ebytes(j, "\x48\x39\xc8", 3);                // cmp rax, rcx
+    e_bool(j, JE);
+    return true;
+  }
+
+  if ((prim == prim_car || prim == prim_cdr) && n == 1) {
+    *expr = (*args)->car;
+    compile_expr(j, expr);
+    int error_stub = e_error_stub(j, prim == prim_car ? "Malformed car" : "Malformed cdr");
+    ebytes(j, "\xa8", 1);                        // test al, CELL_OFFSET
+    e8(j, CELL_OFFSET);
+    e_jump_to(j, JE, error_stub);
+    ebytes(j, "\x48\x8b\x40", 3);                // mov rax, [rax + car/cdr]
+    e8(j, prim == prim_car ? offsetof(Obj, car) : offsetof(Obj, cdr));
+    return true;
+  }
+
+  if ((prim == prim_cons || prim == prim_setcar) && n == 2) {
+    int first = compile_args(j, args);
+    e_slot_addr(j, RDI, first);
+    e_slot_addr(j, RSI, first + 1);
+    e_call(j, prim == prim_cons ? (void *)cons : (void *)jit_setcar);
+    return true;
+  }
+
+  if (prim == prim_println && n == 1) {
+    *expr = (*args)->car;
+    compile_expr(j, expr);
+    ebytes(j, "\x48\x89\xc7", 3);                // mov rdi, rax
+    e_call(j, jit_println);
+    return true;
+  }
+  return false;
+}
+
+// Compiles a form whose head is a symbol bound globally to the given value. Emits a check that the
+// binding still holds the value, and returns the position of the jump taken if it doesn't.
+static int compile_global_form(Jit *j, Obj **form, Obj **bind) {
+  e_load_const(j, RAX, jit_const(j, *bind));
+  ebytes(j, "\x48\x8b\x40", 3);                  // mov rax, [rax + cdr]
+  e8(j, offsetof(Obj, cdr));
+  Obj *value = (*bind)->cdr;
+
+  if (type_of(value) == TFUNCTION) {
+    int fail = e_check_function(j);
+    int fn = new_slot(j);
+    e_store_slot(j, fn);
+    DEFINE1(args);
+    *args = (*form)->cdr;
+    compile_call(j, fn, args, value);
+    return fail;
+  }
+
+  e_load_const(j, RCX, jit_const(j, value));
+  ebytes(j, "\x48\x39\xc8", 3);                  // cmp rax, rcx
+  int fail = e_jump(j, JNE);
+
+  if (type_of(value) == TMACRO) {
+    DEFINE2(macro, expanded);
+    *macro = value;
+    *expanded = (*form)->cdr;
+    *expanded = expand_early(j->genv, macro, expanded);
+    if (!*expanded) {
+      compile_generic(j, form);
+      return fail;
+    }
+    if (++j->expanding == MAX_EXPANSION_DEPTH)
+      error("Too deep macro expansion");
+    compile_expr(j, expanded);
+    j->expanding--;
+    return fail;
+  }
+
+  if (type_of(value) != TPRIMITIVE || !compile_primitive(j, form, value->fn))
+    compile_generic(j, form);
+  return fail;
+}
+
+static void compile_form(Jit *j, Obj **form) {
+  int saved_slots = j->nslots;
+  Obj *head = (*form)->car;
+  int fail = -1;
+
+  if (length(*form) < 0) {
+    // Leave the error to the interpreter.
+  } else if (type_of(head) == TCELL && type_of(head->car) == TSYMBOL && 3 <= length(head) &&
+             is_lambda_list(head->cdr->car)) {
+    // ((lambda ...) ...)
+    Obj *bind = global_bind(j, head->car);
+    if (bind && type_of(bind->cdr) == TPRIMITIVE && bind->cdr->fn == prim_lambda) {
+      e_load_const(j, RAX, jit_const(j, bind));
+      ebytes(j, "\x48\x8b\x40", 3);              // mov rax, [rax + cdr]
+      e8(j, offsetof(Obj, cdr));
+      e_load_const(j, RCX, jit_const(j, bind->cdr));
+      ebytes(j, "\x48\x39\xc8", 3);              // cmp rax, rcx
+      fail = e_jump(j, JNE);
+      compile_lambda_call(j, form);
+    }
+  } else if (type_of(head) == TSYMBOL) {
+    DEFINE1(bind);
+    *bind = global_bind(j, head);
+    if (*bind) {
+      fail = compile_global_form(j, form, bind);
+    } else if (is_local(j, head)) {
+      // A function in a local variable
+      e_env(j, RDI);
+      e_load_const(j, RSI, jit_const(j, head));
+      e_call(j, jit_var);
+      fail = e_check_function(j);
+      int fn = new_slot(j);
+      e_store_slot(j, fn);
+      DEFINE1(args);
+      *args = (*form)->cdr;
+      compile_call(j, fn, args, NULL);
+    }
+  }
+
+  if (fail < 0) {
+    compile_generic(j, form);
+  } else {
+    // The check failed. Let the interpreter evaluate the form.
+    int end = e_jump(j, JMP);
+    e_patch(j, fail);
+    compile_generic(j, form);
+    e_patch(j, end);
+  }
+  j->nslots = saved_slots;
+}
+
+// Compiles the expression. The code leaves the value in rax.
+static void compile_expr(Jit *j, Obj **expr) {
+  if (j->failed)
+    return;
+  switch (type_of(*expr)) {
+  case TSYMBOL:
+    e_env(j, RDI);
+    e_load_const(j, RSI, jit_const(j, *expr));
+    e_call(j, jit_var);
+    return;
+  case TCELL:
+    compile_form(j, expr);
+    return;
+  case TTRUE:
+  case TNIL:
+    e_imm(j, RAX, (uintptr_t)*expr);
+    return;
+  default:
+    e_load_const(j, RAX, jit_const(j, *expr));
+  }
+}
+
+// Compiles the body of the function. Returns NULL if it cannot be compiled.
+static JitCode *jit_compile(Obj **fn, Obj **env) {
+  JitFunc *func = jit_funcs[(*fn)->jit];
+  Jit *j = calloc(1, sizeof(Jit));
+  j->func = func;
+  j->env_slot = -1;
+  DEFINE3(scopes, genv, body);
+  j->scopes = scopes;
+  j->genv = genv;
+  *scopes = (*fn)->params;
+  *scopes = cons(scopes, &func->scopes);
+  for (*genv = *env; (*genv)->up != Nil; *genv = (*genv)->up)
+    ;
+  *body = (*fn)->body;
+
+  // Prologue
+  ebytes(j, "\x53\x41\x54\x41\x55", 5);          // push rbx; push r12; push r13
+  ebytes(j, "\x48\x89\xfb", 3);                  // mov rbx, rdi
+  e8(j, 0xbf);                                   // mov edi, nslots
+  int nslots_at = j->len;
+  e32(j, 0);
+  e_call(j, jit_enter);
+  ebytes(j, "\x49\x89\xc4", 3);                  // mov r12, rax
+  ebytes(j, "\x49\xbd", 2);                      // mov r13, consts
+  int consts_at = j->len;
+  e64(j, 0);
+
+  // A macro expansion may fail even if the code would never run. Give up compiling then.
+  jmp_buf jb;
+  jmp_buf *saved_handler = error_handler;
+  Obj **sp = root_sp;
+  int saved_depth = depth;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    compile_body(j, body);
+  } else {
+    root_sp = sp;
+    depth = saved_depth;
+    j->failed = true;
+  }
+  error_handler = saved_handler;
+
+  // Epilogue
+  e_imm(j, RCX, (uintptr_t)&root_sp);
+  ebytes(j, "\x4c\x89\x21", 3);                  // mov [rcx], r12
+  ebytes(j, "\x41\x5d\x41\x5c\x5b\xc3", 6);      // pop r13; pop r12; pop rbx; ret
+
+  JitCode *code = NULL;
+  if (!j->failed) {
+    uint32_t nslots = j->max_slots;
+    memcpy(j->buf + nslots_at, &nslots, 4);
+    uint64_t consts = (uintptr_t)func->consts;
+    memcpy(j->buf + consts_at, &consts, 8);
+    size_t size = roundup(j->len, 4096);
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (mem != MAP_FAILED) {
+      memcpy(mem, j->buf, j->len);
+      mprotect(mem, size, PROT_READ | PROT_EXEC);
+      code = mem;
+    }
+  }
+  free(j->buf);
+  free(j);
+  return code;
+}
+
+// Returns the compiled code of the function, compiling it if it has been called often enough.
+static JitCode *jit_code(Obj **fn, Obj **env) {
+  JitFunc *f = jit_funcs[(*fn)->jit];
+  if (f->code || f->failed || f->compiling || !jit_threshold || ++f->calls < jit_threshold)
+    return f->code;
+  f->compiling = true;
+  f->code = jit_compile(fn, env);
+  f->compiling = false;
+  f->failed = !f->code;
+  return f->code;
+}
+
+//======================================================================
+// Read-eval-print loop
+//======================================================================
+
+// Sets up the global environment of a fresh heap.
+static void init_env(Obj **env) {
+  Symbols = Nil;
+  *env = make_env(&Nil, &Nil);
+  define_constants(env);
+  define_primitives(env);
+}
+
+// Reads and evaluates expressions from the input stream until EOF. Prints the value of each
+// expression if echo is true.
+static void eval_input(Obj **env, bool echo) {
+  DEFINE1(expr);
+  for (;;) {
+    *expr = read_expr();
+    if (!*expr)
+      return;
+    if (*expr == Cparen)
+      error("Stray close parenthesis");
+    if (*expr == Dot)
+      error("Stray dot");
+    *expr = eval(env, expr);
+    if (echo) {
+      print(*expr);
+      fprintf(output, "\n");
+    }
+  }
+}
+
+//======================================================================
+// Batch mode
+//
+// "minilisp --batch [-j N] [--prelude FILE] FILE-OR-DIR ..." evaluates each file as an independent
+// script on N worker threads. The prelude is evaluated only once, and its heap is frozen into a
+// read-only image. Every script starts from a private copy of the image, so scripts can neither
+// see nor disturb each other, and no locking is needed while evaluating.
+//======================================================================
+
+// A snapshot of a heap containing the global environment after the prelude has been evaluated.
+typedef struct {
+  Space heap;
+  Obj *symbols;
+  Obj *env;
+  int gensym_count;
+  int defs_epoch;
+} Image;
+
+// A script to evaluate and its result.
+typedef struct {
+  char *path;
+  char *out;
+  size_t outlen;
+  bool failed;
+  char msg[sizeof(error_msg)];
+  double msec;
+} Job;
+
+static Image prelude;
+static Job *jobs;
+static int njobs;
+static int next_job;
+
+static double now_msec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Builds the prelude image on the current thread. The thread's heap is handed over to the image.
+static void make_image(Image *img, char *path) {
+  init_heap();
+  DEFINE1(env);
+  init_env(env);
+  if (path) {
+    input = fopen(path, "r");
+    if (!input)
+      error("%s: cannot open", path);
+    eval_input(env, false);
+    fclose(input);
+  }
+  // Drop the garbage so that the copy made for each script is as small as possible, and so that
+  // the objects can be visited in order.
+  compact_heap();
+  img->heap = heap;
+  img->symbols = Symbols;
+  img->env = *env;
+  img->gensym_count = gensym_count;
+  img->defs_epoch = defs_epoch;
+  mprotect(img->heap.start, MEMORY_SIZE, PROT_READ);
+  heap.start = NULL;
+}
+
+// The heap being relocated and the distance to move, used by relocate().
+static THREAD_LOCAL Space *reloc_space;
+static THREAD_LOCAL ptrdiff_t reloc_delta;
+
+static Obj *relocate(Obj *obj) {
+  if (!in_space(reloc_space, obj))
+    return obj;
+  return (Obj *)((uint8_t *)obj + reloc_delta);
+}
+
+// Makes the current thread's heap a private copy of the image. Because the heap after GC is a
+// sequence of objects without gaps, the copy can be fixed up by visiting each object in order.
+static Obj *clone_image(Image *img) {
+  init_heap();
+  Space *src = &img->heap;
+  memcpy(heap.start, src->start, src->ncells);
+  memcpy(heap.start + MEMORY_SIZE - src->nobjs, src->start + MEMORY_SIZE - src->nobjs, src->nobjs);
+  heap.ncells = src->ncells;
+  heap.nobjs = src->nobjs;
+  reloc_space = src;
+  reloc_delta = heap.start - src->start;
+  scan_space(&heap, relocate);
+  Symbols = relocate(img->symbols);
+  gensym_count = img->gensym_count;
+  defs_epoch = img->defs_epoch;
+  return relocate(img->env);
+}
+
+static void run_job(Job *job) {
+  FILE *in = fopen(job->path, "r");
+  if (!in) {
+    job->failed = true;
+    snprintf(job->msg, sizeof(job->msg), "cannot open");
+    return;
+  }
+  input = in;
+  output = open_memstream(&job->out, &job->outlen);
+  double start = now_msec();
+
+  DEFINE1(env);
+  *env = clone_image(&prelude);
+  reset_limits();
+  Obj **sp = root_sp;
+  jmp_buf jb;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    eval_input(env, true);
+  } else {
+    job->failed = true;
+    strcpy(job->msg, error_msg);
+    gc_running = false;
+    root_sp = sp;
+  }
+  error_handler = NULL;
+  abort_gc_cycle();
+  free_semispace(heap.start);
+  heap.start = NULL;
+
+  job->msec = now_msec() - start;
+  fclose(output);
+  fclose(in);
+}
+
+static void *batch_worker(void *arg) {
+  init_root_stack();
+  for (;;) {
+    int i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+    if (njobs <= i)
+      break;
+    run_job(&jobs[i]);
+  }
+  free_root_stack();
+  return NULL;
+}
+
+static void add_job(char *path) {
+  jobs = realloc(jobs, sizeof(Job) * (njobs + 1));
+  jobs[njobs++] = (Job){ .path = path };
+}
+
+static int is_script(const struct dirent *ent) {
+  size_t len = strlen(ent->d_name);
+  return ent->d_name[0] != '.' && 5 < len && strcmp(ent->d_name + len - 5, ".lisp") == 0;
+}
+
+// Adds a job for the given file, or for each *.lisp file in it if it's a directory.
+static void add_jobs(char *path) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    add_job(path);
+    return;
+  }
+  closedir(dir);
+  struct dirent **ents;
+  int n = scandir(path, &ents, is_script, alphasort);
+  if (n < 0)
+    error("%s: cannot read directory", path);
+  for (int i = 0; i < n; i++) {
+    char *buf = malloc(strlen(path) + strlen(ents[i]->d_name) + 2);
+    sprintf(buf, "%s/%s", path, ents[i]->d_name);
+    add_job(buf);
+    free(ents[i]);
+  }
+  free(ents);
+}
+
+static int batch_main(int argc, char **argv) {
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  char *prelude_path = NULL;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      nthreads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--prelude") == 0 && i + 1 < argc)
+      prelude_path = argv[++i];
+    else
+      add_jobs(argv[i]);
+  }
+  if (nthreads < 1)
+    nthreads = 1;
+
+  double start = now_msec();
+  make_image(&prelude, prelude_path);
+
+  pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, batch_worker, NULL))
+      error("Cannot create a thread");
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = now_msec() - start;
+
+  int nfailed = 0;
+  for (int i = 0; i < njobs; i++) {
+    Job *job = &jobs[i];
+    printf(";; %s: %s (%.3f ms)\n", job->path, job->failed ? "FAILED" : "ok", job->msec);
+    if (job->out)
+      fwrite(job->out, 1, job->outlen, stdout);
+    if (job->failed) {
+      printf(";; error: %s\n", job->msg);
+      nfailed++;
+    }
+    free(job->out);
+  }
+  fprintf(stderr, ";; %d files, %d failed, %d threads, %.3f ms (%.1f files/s)\n",
+          njobs, nfailed, nthreads, elapsed, njobs / (elapsed / 1e3));
+  return nfailed ? 1 : 0;
+}
+
+//======================================================================
+// Server mode
+//
+// "minilisp --serve SOCKET [--prelude FILE]" evaluates the prelude once and then serves requests on
+// a Unix domain socket. A request is the text of a program, terminated by closing the writing side
+// of the connection. The server forks for each connection, and the child evaluates the program in
+// the warm heap and global environment it inherited, writing the value of each expression back as
+// the interactive mode does, followed by ";; error: <message>" if it fails. The pages of the heap
+// are copied on write, so a request cannot see or disturb what another one does.
+//
+// "minilisp --connect SOCKET" sends the standard input as a request and copies the response to the
+// standard output.
+//======================================================================
+
+static void serve_request(Obj **env, int conn) {
+  // The parent's pmap workers do not exist in the child. The pool is started again if needed.
+  pool.workers = NULL;
+  input = fdopen(conn, "r");
+  output = fdopen(dup(conn), "w");
+  setvbuf(output, NULL, _IOLBF, 0);
+  reset_limits();
+  jmp_buf jb;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    eval_input(env, true);
+  } else {
+    fprintf(output, ";; error: %s\n", error_msg);
+  }
+  fclose(output);
+  fclose(input);
+}
+
+static int serve_main(int argc, char **argv) {
+  char *path = NULL;
+  char *prelude_path = NULL;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "--prelude") == 0 && i + 1 < argc)
+      prelude_path = argv[++i];
+    else
+      path = argv[i];
+  }
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (!path || sizeof(addr.sun_path) <= strlen(path))
+    error("Usage: minilisp --serve SOCKET [--prelude FILE]");
+  strcpy(addr.sun_path, path);
+  // A socket left by a previous server is replaced, but nothing else is.
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode))
+      error("%s: not a socket", path);
+    unlink(path);
+  }
+
+  init_heap();
+  DEFINE1(env);
+  init_env(env);
+  if (prelude_path) {
+    input = fopen(prelude_path, "r");
+    if (!input)
+      error("%s: cannot open", prelude_path);
+    eval_input(env, false);
+    fclose(input);
+  }
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 128) < 0)
+    error("%s: cannot listen", path);
+  // The children are reaped by the system.
+  signal(SIGCHLD, SIG_IGN);
+  fflush(stdout);
+  for (;;) {
+    int conn = accept(sock, NULL, NULL);
+    if (conn < 0)
+      continue;
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(sock);
+      serve_request(env, conn);
+      _exit(0);
+    }
+    if (pid < 0)
+      fprintf(stderr, "%s: cannot fork\n", path);
+    close(conn);
+  }
+}
+
+static void copy_fd(int from, int to) {
+  char buf[4096];
+  ssize_t n;
+  while (0 < (n = read(from, buf, sizeof(buf))))
+    for (ssize_t off = 0, w; off < n; off += w)
+      if ((w = write(to, buf + off, n - off)) < 0)
+        return;
+}
+
+// The whole request is sent before the response is read. The response of a program that prints a
+// lot before its input has been read may fill the socket buffer, so a request should be a program
+// that fits in it.
+static int connect_main(int argc, char **argv) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (argc != 1 || sizeof(addr.sun_path) <= strlen(argv[0]))
+    error("Usage: minilisp --connect SOCKET");
+  strcpy(addr.sun_path, argv[0]);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    error("%s: cannot connect", argv[0]);
+  copy_fd(0, sock);
+  shutdown(sock, SHUT_WR);
+  copy_fd(sock, 1);
+  close(sock);
+  return 0;
+}
+
+//======================================================================
+// Sampling profiler
+//
+// With MINILISP_SAMPLE_HZ=N, a SIGPROF timer ticks N times per second of CPU time, and the Lisp
+// call stack of the main thread is recorded at the next safepoint after each tick. The stack is a
+// shadow stack of the functions being applied, which apply_func() maintains at the index of the
+// call depth. As the depth is restored with root_sp after an error is caught, so is the stack.
+// The signal handler only counts the ticks, so nothing is done in the handler that could disturb
+// the interpreter.
+//
+// At exit, the stacks are written in the "collapsed" format of flame graph tools, one line per
+// distinct stack with the outermost function first and the number of ticks, to the file named by
+// MINILISP_SAMPLE_FILE or to stderr. Functions are named by the variable they are bound to in
+// their environment, or "lambda".
+//======================================================================
+
+typedef struct {
+  char *stack;
+  long count;
+} Sample;
+
+static int prof_cap;
+static Sample *samples;  // a hash table keyed by the stack
+static int nsamples;
+static int samples_cap;
+static char *prof_file;
+
+static void prof_tick(int sig) {
+  __atomic_fetch_add(&sample_pending, 1, __ATOMIC_RELAXED);
+}
+
+static void prof_push(Obj *fn) {
+  if (depth == prof_cap) {
+    prof_cap *= 2;
+    prof_stack = realloc(prof_stack, sizeof(Obj *) * prof_cap);
+  }
+  prof_stack[depth] = fn;
+}
+
+static void forward_prof_roots(Obj *(*fn)(Obj *)) {
+  if (prof_stack)
+    for (int i = 0; i < depth; i++)
+      prof_stack[i] = fn(prof_stack[i]);
+}
+
+static char *prof_name(Obj *fn) {
+  for (Obj *frame = fn->env; frame != Nil; frame = frame->up)
+    for (Obj *cell = frame->vars; cell != Nil; cell = cell->cdr)
+      if (cell->car->cdr == fn && type_of(cell->car->car) == TSYMBOL)
+        return cell->car->car->name;
+  return "lambda";
+}
+
+static uint32_t hash_string(char *s) {
+  uint32_t h = 2166136261u;
+  for (; *s; s++)
+    h = (h ^ (uint8_t)*s) * 16777619u;
+  return h;
+}
+
+static Sample *find_sample(char *stack) {
+  int i = hash_string(stack) & (samples_cap - 1);
+  while (samples[i].stack && strcmp(samples[i].stack, stack))
+    i = (i + 1) & (samples_cap - 1);
+  return &samples[i];
+}
+
+static void add_sample(char *stack, long count) {
+  if (samples_cap <= nsamples * 2) {
+    Sample *old = samples;
+    int cap = samples_cap;
+    samples_cap = cap ? cap * 2 : 256;
+    samples = calloc(samples_cap, sizeof(Sample));
+    for (int i = 0; i < cap; i++)
+      if (old[i].stack)
+        *find_sample(old[i].stack) = old[i];
+    free(old);
+  }
+  Sample *s = find_sample(stack);
+  if (!s->stack) {
+    s->stack = strdup(stack);
+    nsamples++;
+  }
+  s->count += count;
+}
+
+static void take_sample(void) {
+  long count = __atomic_exchange_n(&sample_pending, 0, __ATOMIC_RELAXED);
+  char *buf;
+  size_t len;
+  FILE *out = open_memstream(&buf, &len);
+  if (depth == 0)
+    fprintf(out, "(toplevel)");
+  for (int i = 0; i < depth; i++)
+    fprintf(out, "%s%s", i ? ";" : "", prof_name(prof_stack[i]));
+  fclose(out);
+  add_sample(buf, count);
+  free(buf);
+}
+
+static void write_profile(void) {
+  FILE *out = prof_file ? fopen(prof_file, "w") : stderr;
+  if (!out) {
+    fprintf(stderr, "%s: cannot open\n", prof_file);
+    return;
+  }
+  for (int i = 0; i < samples_cap; i++)
+    if (samples[i].stack)
+      fprintf(out, "%s %ld\n", samples[i].stack, samples[i].count);
+  if (out != stderr)
+    fclose(out);
+}
+
+static void start_profiler(int hz) {
+  prof_cap = 256;
+  prof_stack = malloc(sizeof(Obj *) * prof_cap);
+  prof_file = getenv("MINILISP_SAMPLE_FILE");
+  atexit(write_profile);
+  struct sigaction sa = { .sa_handler = prof_tick, .sa_flags = SA_RESTART };
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+  long usec = 1000000 / hz < 1 ? 1 : 1000000 / hz;
+  struct timeval interval = { usec / 1000000, usec % 1000000 };
+  struct itimerval timer = { interval, interval };
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+//======================================================================
+// Ahead-of-time compiler
+//
+// "minilisp --compile-c FILE" translates a program to C. The C code includes this file and builds
+// into a standalone binary that behaves like "./minilisp < FILE":
+//
+//   $ ./minilisp --compile-c prog.lisp > prog.c
+//   $ cc -O2 -I<directory of minilisp.c> prog.c -lpthread -o prog
+//
+// The compiler evaluates the top-level defun and defmacro forms as it reads them, so that the
+// macros used in the rest of the program are expanded once by macroexpand() at compile time. The
+// rest works like the JIT compiler: the common primitives and calls to functions are translated to
+// C, each guarded by a check of the global binding at runtime, and the other forms are evaluated by
+// the interpreter. As the compiler sees all the lambdas a function is nested in, local variables
+// are accessed by their position in the environment frames rather than searched for by name.
+//
+// The objects the code refers to are printed into a string, and the reader reads them back when the
+// program starts.
+//======================================================================
+
+// The compiled functions and the global environment of the running program
+static int *aot_index;
+static Obj **aot_genv;
+
+// Runtime functions called by the generated code
+
+static inline void aot_init(char *src, int nconsts, JitCode **code, int ncode) {
+  aot_consts = calloc(nconsts * 2 + 1, sizeof(Obj *));
+  FILE *saved = input;
+  input = fmemopen(src, strlen(src), "r");
+  DEFINE2(list, p);
+  *list = read_expr();
+  fclose(input);
+  input = saved;
+  // See print_constants() for the format.
+  int i = 0;
+  for (*p = *list; *p != Nil; *p = (*p)->cdr, i++)
+    if ((*p)->car->car->value == 0)
+      aot_consts[i] = (*p)->car->cdr;
+  i = 0;
+  for (*p = *list; *p != Nil; *p = (*p)->cdr, i++) {
+    Obj *entry = (*p)->car;
+    if (entry->car->value == 0)
+      continue;
+    Obj *obj = aot_consts[entry->cdr->car->value];
+    for (Obj *path = entry->cdr->cdr; path != Nil; path = path->cdr)
+      for (int bits = path->car->value; bits != 1; bits >>= 1)
+        obj = (bits & 1) ? obj->cdr : obj->car;
+    aot_consts[i] = obj;
+  }
+  aot_nconsts = nconsts;
+
+  aot_index = malloc(sizeof(int) * ncode);
+  for (int i = 0; i < ncode; i++) {
+    aot_index[i] = jit_register(Nil);
+    if (aot_index[i])
+      jit_funcs[aot_index[i]]->code = code[i];
+  }
+}
+
+// Returns the binding of the constant k in the frame depth frames up from env.
+static inline Obj *aot_frame_bind(Obj **env, int depth, int index) {
+  Obj *frame = *env;
+  while (depth--)
+    frame = frame->up;
+  Obj *vars = frame->vars;
+  while (index--)
+    vars = vars->cdr;
+  return vars->car;
+}
+
+// Returns the global binding of the symbol in the constant k, or NULL.
+static inline Obj *aot_global(int k) {
+  Obj **cache = &aot_consts[aot_nconsts + k];
+  if (!*cache)
+    *cache = find(aot_genv, aot_consts[k]);
+  return *cache;
+}
+
+static inline Obj *aot_var(int k) {
+  Obj *bind = aot_global(k);
+  if (!bind)
+    error("Undefined symbol: %s", aot_consts[k]->name);
+  return bind->cdr;
+}
+
+static inline Obj *aot_global_bind(int k) {
+  Obj *bind = aot_global(k);
+  if (!bind)
+    error("Unbound variable %s", aot_consts[k]->name);
+  return bind;
+}
+
+static inline bool aot_is_primitive(int k, Primitive *fn) {
+  Obj *bind = aot_global(k);
+  return bind && type_of(bind->cdr) == TPRIMITIVE && bind->cdr->fn == fn;
+}
+
+static inline bool aot_is_macro(int k, int body) {
+  Obj *bind = aot_global(k);
+  return bind && type_of(bind->cdr) == TMACRO && bind->cdr->body == aot_consts[body];
+}
+
+// Returns the global function bound to the constant k, or NULL.
+static inline Obj *aot_function(int k) {
+  Obj *bind = aot_global(k);
+  return bind && type_of(bind->cdr) == TFUNCTION ? bind->cdr : NULL;
+}
+
+// (defun <symbol> ...) and (defmacro <symbol> ...) at the top level
+static inline Obj *aot_define(Obj **env, int sym, int params, int body, int type, int code) {
+  DEFINE4(s, p, b, fn);
+  *s = aot_consts[sym];
+  *p = aot_consts[params];
+  *b = aot_consts[body];
+  *fn = make_function(env, type, p, b);
+  if (0 <= code)
+    (*fn)->jit = aot_index[code];
+  add_variable(env, s, fn);
+  return *fn;
+}
+
+static inline Obj *aot_progn(Obj **env, Obj *body) {
+  DEFINE1(list);
+  *list = body;
+  return progn(env, list);
+}
+
+static inline Obj *aot_plus(Obj **args, int n) {
+  int sum = 0;
+  for (int i = 0; i < n; i++) {
+    if (type_of(args[i]) != TINT)
+      error("+ takes only numbers");
+    sum += args[i]->value;
+  }
+  return make_int(sum);
+}
+
+static inline Obj *aot_minus(Obj **args, int n) {
+  for (int i = 0; i < n; i++)
+    if (type_of(args[i]) != TINT)
+      error("- takes only numbers");
+  if (n == 1)
+    return make_int(-args[0]->value);
+  int r = args[0]->value;
+  for (int i = 1; i < n; i++)
+    r -= args[i]->value;
+  return make_int(r);
+}
+
+static inline Obj *aot_lt(Obj *x, Obj *y) {
+  if (type_of(x) != TINT || type_of(y) != TINT)
+    error("< takes only numbers");
+  return x->value < y->value ? True : Nil;
+}
+
+static inline Obj *aot_num_eq(Obj *x, Obj *y) {
+  if (type_of(x) != TINT || type_of(y) != TINT)
+    error("= only takes numbers");
+  return x->value == y->value ? True : Nil;
+}
+
+static inline Obj *aot_car(Obj *obj) {
+  if (type_of(obj) != TCELL)
+    error("Malformed car");
+  return obj->car;
+}
+
+static inline Obj *aot_cdr(Obj *obj) {
+  if (type_of(obj) != TCELL)
+    error("Malformed cdr");
+  return obj->cdr;
+}
+
+#ifdef MINILISP_AOT
+// Runs the compiled program. Defined by the generated code.
+static void aot_load(Obj **env);
+#endif
+
+// Code generation
+
+// A C function being generated
+typedef struct {
+  FILE *out;
+  char *buf;
+  size_t len;
+  int indent;
+  int nslots;      // the number of slots in use at this point
+  int max_slots;
+  char env[16];    // the C expression for the current environment
+  bool defining;   // true if the function may add a local variable
+} AotFunc;
+
+typedef struct {
+  AotFunc *fn;
+  Obj **scopes;    // the parameter lists of the frames in scope, innermost first
+  Obj **genv;      // the global environment at compile time
+  Obj **consts;    // the constants in reverse order
+  int nconsts;
+  int nfuncs;
+  int expanding;   // the number of macro expansions the current form is in
+  FILE *funcs;     // the finished functions
+} Aot;
+
+static void emit(Aot *a, char *fmt, ...) {
+  fprintf(a->fn->out, "%*s", a->fn->indent * 2, "");
+  va_list ap;
+  va_start(ap, fmt);
+  vfprintf(a->fn->out, fmt, ap);
+  va_end(ap);
+  fprintf(a->fn->out, "\n");
+}
+
+static int aot_slot(Aot *a) {
+  if (a->fn->max_slots < ++a->fn->nslots)
+    a->fn->max_slots = a->fn->nslots;
+  return a->fn->nslots - 1;
+}
+
+// Returns the index of the object in the constant table, adding it if needed.
+static int aot_const(Aot *a, Obj *obj) {
+  int i = a->nconsts - 1;
+  for (Obj *p = *a->consts; p != Nil; p = p->cdr, i--)
+    if (p->car == obj)
+      return i;
+  DEFINE1(tmp);
+  *tmp = obj;
+  *a->consts = cons(tmp, a->consts);
+  return a->nconsts++;
+}
+
+// True if the object can be printed and read back as the same object.
+static bool is_readable(Obj *obj) {
+  for (; type_of(obj) == TCELL; obj = obj->cdr)
+    if (!is_readable(obj->car))
+      return false;
+  return obj == Nil || type_of(obj) == TINT || type_of(obj) == TSYMBOL;
+}
+
+// Finds the local variable. Returns false if the symbol refers to a global variable.
+static bool aot_lookup(Aot *a, Obj *sym, int *depth, int *index) {
+  *depth = 0;
+  for (Obj *s = *a->scopes; s != Nil; s = s->cdr, (*depth)++) {
+    // push_env() adds the parameters to the front of the frame in order.
+    int n = 0, found = -1;
+    Obj *p = s->car;
+    for (; type_of(p) == TCELL; p = p->cdr, n++)
+      if (p->car == sym)
+        found = n;
+    if (p != Nil && p == sym)
+      found = n;
+    if (p != Nil)
+      n++;
+    if (0 <= found) {
+      *index = n - 1 - found;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Expands the macro application form. Returns false if it fails or if the expansion contains
+// objects that cannot be put in the constant table.
+static bool aot_expand(Aot *a, Obj **form, Obj **macro, Obj **expanded) {
+  jmp_buf jb;
+  jmp_buf *saved_handler = error_handler;
+  Obj **sp = root_sp;
+  int saved_depth = depth;
+  bool ok = false;
+  if (setjmp(jb) == 0) {
+    error_handler = &jb;
+    *expanded = (*form)->cdr;
+    *expanded = apply_func(a->genv, macro, expanded);
+    ok = is_readable(*expanded);
+  } else {
+    root_sp = sp;
+    depth = saved_depth;
+  }
+  error_handler = saved_handler;
+  return ok;
+}
+
+// The C name of a primitive the compiler has a fast path for
+static char *aot_primitive_name(Primitive *fn) {
+#define CASE(prim) if (fn == prim) return #prim
+  CASE(prim_quote);
+  CASE(prim_if);
+  CASE(prim_progn);
+  CASE(prim_let);
+  CASE(prim_cond);
+  CASE(prim_and);
+  CASE(prim_or);
+  CASE(prim_while);
+  CASE(prim_dotimes);
+  CASE(prim_setq);
+  CASE(prim_lambda);
+  CASE(prim_plus);
+  CASE(prim_minus);
+  CASE(prim_lt);
+  CASE(prim_num_eq);
+  CASE(prim_eq);
+  CASE(prim_car);
+  CASE(prim_cdr);
+  CASE(prim_cons);
+  CASE(prim_setcar);
+  CASE(prim_println);
+#undef CASE
+  return NULL;
+}
+
+static void aot_compile_expr(Aot *a, Obj **expr, int dst);
+static int aot_compile_function(Aot *a, Obj **params, Obj **body);
+
+static void aot_compile_body(Aot *a, Obj **body, int dst) {
+  DEFINE2(lp, expr);
+  for (*lp = *body; *lp != Nil; *lp = (*lp)->cdr) {
+    *expr = (*lp)->car;
+    aot_compile_expr(a, expr, dst);
+  }
+}
+
+// Evaluates the form in the interpreter.
+static void aot_compile_generic(Aot *a, Obj **form, int dst) {
+  if (is_defining(*form))
+    a->fn->defining = true;
+  emit(a, "r[%d] = jit_eval(%s, aot_consts[%d]);", dst, a->fn->env, aot_const(a, *form));
+}
+
+// Evaluates the elements of the list to new slots. Returns the first slot.
+static int aot_compile_args(Aot *a, Obj **list) {
+  int first = a->fn->nslots;
+  DEFINE2(lp, expr);
+  for (*lp = *list; *lp != Nil; *lp = (*lp)->cdr) {
+    *expr = (*lp)->car;
+    aot_compile_expr(a, expr, aot_slot(a));
+  }
+  return first;
+}
+
+// Conses up the values in the n slots starting at first into a list in a new slot.
+static int aot_compile_list(Aot *a, int first, int n) {
+  int list = aot_slot(a);
+  emit(a, "r[%d] = Nil;", list);
+  for (int i = first + n - 1; first <= i; i--)
+    emit(a, "r[%d] = cons(&r[%d], &r[%d]);", list, i, list);
+  return list;
+}
+
+// Calls the function in the slot with the arguments of the form.
+static void aot_compile_call(Aot *a, int fn, Obj **form, int dst) {
+  DEFINE1(args);
+  *args = (*form)->cdr;
+  int n = length(*args);
+  int first = aot_compile_args(a, args);
+  int list = aot_compile_list(a, first, n);
+  emit(a, "r[%d] = jit_apply(&r[%d], &r[%d]);", dst, fn, list);
+}
+
+// Evaluates the body with the parameters bound to the values of the arguments.
+static void aot_compile_binding(Aot *a, Obj **params, Obj **args, Obj **body, int dst) {
+  DEFINE1(saved_scopes);
+  int n = length(*args);
+  int first = aot_compile_args(a, args);
+  if (*params == Nil && n == 0) {
+    // The frame would be empty.
+    aot_compile_body(a, body, dst);
+    return;
+  }
+  int list = aot_compile_list(a, first, n);
+  int env = aot_slot(a);
+  emit(a, "r[%d] = jit_push_env(%s, aot_consts[%d], &r[%d]);", env, a->fn->env,
+       aot_const(a, *params), list);
+
+  char saved_env[sizeof(a->fn->env)];
+  strcpy(saved_env, a->fn->env);
+  *saved_scopes = *a->scopes;
+  *a->scopes = cons(params, a->scopes);
+  snprintf(a->fn->env, sizeof(a->fn->env), "&r[%d]", env);
+  aot_compile_body(a, body, dst);
+  strcpy(a->fn->env, saved_env);
+  *a->scopes = *saved_scopes;
+}
+
+// ((lambda (<symbol> ...) expr ...) expr ...)
+static void aot_compile_lambda_call(Aot *a, Obj **form, int dst) {
+  DEFINE3(params, body, args);
+  *params = (*form)->car->cdr->car;
+  *body = (*form)->car->cdr->cdr;
+  *args = (*form)->cdr;
+  aot_compile_binding(a, params, args, body, dst);
+}
+
+// Compiles the application of a primitive. Returns false if it's not one the compiler knows.
+static bool aot_compile_primitive(Aot *a, Obj **form, Primitive *prim, int dst) {
+  DEFINE2(args, expr);
+  *args = (*form)->cdr;
+  int n = length(*args);
+
+  if (prim == prim_quote && n == 1) {
+    emit(a, "r[%d] = aot_consts[%d];", dst, aot_const(a, (*args)->car));
+    return true;
+  }
+
+  if (prim == prim_if && 2 <= n) {
+    *expr = (*args)->car;
+    aot_compile_expr(a, expr, dst);
+    emit(a, "if (r[%d] != Nil) {", dst);
+    a->fn->indent++;
+    *expr = (*args)->cdr->car;
+    aot_compile_expr(a, expr, dst);
+    a->fn->indent--;
+    emit(a, "} else {");
+    a->fn->indent++;
+    *expr = (*args)->cdr->cdr;
+    if (*expr == Nil)
+      emit(a, "r[%d] = Nil;", dst);
+    else
+      aot_compile_body(a, expr, dst);
+    a->fn->indent--;
+    emit(a, "}");
+    return true;
+  }
+
+  if (prim == prim_progn) {
+    if (n == 0)
+      emit(a, "r[%d] = Nil;", dst);
+    else
+      aot_compile_body(a, args, dst);
+    return true;
+  }
+
+  if (prim == prim_and || prim == prim_or) {
+    if (n == 0) {
+      emit(a, "r[%d] = %s;", dst, prim == prim_and ? "True" : "Nil");
+      return true;
+    }
+    emit(a, "do {");
+    a->fn->indent++;
+    for (*expr = *args; *expr != Nil; *expr = (*expr)->cdr) {
+      DEFINE1(arg);
+      *arg = (*expr)->car;
+      aot_compile_expr(a, arg, dst);
+      if ((*expr)->cdr != Nil) {
+        emit(a, "if (r[%d] %s Nil)", dst, prim == prim_and ? "==" : "!=");
+        emit(a, "  break;");
+      }
+    }
+    a->fn->indent--;
+    emit(a, "} while (0);");
+    return true;
+  }
+
+  if (prim == prim_cond) {
+    for (Obj *p = *args; p != Nil; p = p->cdr)
+      if (length(p->car) < 1)
+        return false;
+    emit(a, "do {");
+    a->fn->indent++;
+    for (*expr = *args; *expr != Nil; *expr = (*expr)->cdr) {
+      DEFINE1(clause);
+      *clause = (*expr)->car->car;
+      aot_compile_expr(a, clause, dst);
+      *clause = (*expr)->car->cdr;
+      emit(a, "if (r[%d] != Nil) {", dst);
+      a->fn->indent++;
+      aot_compile_body(a, clause, dst);
+      emit(a, "break;");
+      a->fn->indent--;
+      emit(a, "}");
+    }
+    emit(a, "r[%d] = Nil;", dst);
+    a->fn->indent--;
+    emit(a, "} while (0);");
+    return true;
+  }
+
+  if (prim == prim_let && 2 <= n && is_let_bindings((*args)->car)) {
+    DEFINE3(params, vals, tmp);
+    *params = *vals = Nil;
+    for (*expr = (*args)->car; *expr != Nil; *expr = (*expr)->cdr) {
+      *tmp = (*expr)->car->car;
+      *params = cons(tmp, params);
+      *tmp = (*expr)->car->cdr->car;
+      *vals = cons(tmp, vals);
+    }
+    *params = reverse(*params);
+    *vals = reverse(*vals);
+    *expr = (*args)->cdr;
+    aot_compile_binding(a, params, vals, expr, dst);
+    return true;
+  }
+
+  if (prim == prim_dotimes && 1 <= n && is_dotimes_spec((*args)->car)) {
+    int count = aot_slot(a);
+    *expr = (*args)->car->cdr->car;
+    aot_compile_expr(a, expr, count);
+    int frame = aot_slot(a);
+    emit(a, "r[%d] = dotimes_env(%s, aot_consts[%d], r[%d]);", frame, a->fn->env,
+         aot_const(a, (*args)->car->car), count);
+
+    DEFINE2(params, saved_scopes);
+    char saved_env[sizeof(a->fn->env)];
+    strcpy(saved_env, a->fn->env);
+    *params = (*args)->car->car;
+    *params = cons(params, &Nil);
+    *saved_scopes = *a->scopes;
+    *a->scopes = cons(params, a->scopes);
+    snprintf(a->fn->env, sizeof(a->fn->env), "&r[%d]", frame);
+    emit(a, "for (; dotimes_test(&r[%d], r[%d]) != Nil; dotimes_next(&r[%d])) {", frame, count,
+         frame);
+    a->fn->indent++;
+    *expr = (*args)->cdr;
+    aot_compile_body(a, expr, dst);
+    a->fn->indent--;
+    emit(a, "}");
+    *expr = (*args)->car->cdr->cdr;
+    if (*expr == Nil)
+      emit(a, "r[%d] = Nil;", dst);
+    else
+      aot_compile_body(a, expr, dst);
+    strcpy(a->fn->env, saved_env);
+    *a->scopes = *saved_scopes;
+    return true;
+  }
+
+  if (prim == prim_while && 2 <= n) {
+    emit(a, "for (;;) {");
+    a->fn->indent++;
+    emit(a, "safepoint();");
+    *expr = (*args)->car;
+    aot_compile_expr(a, expr, dst);
+    emit(a, "if (r[%d] == Nil)", dst);
+    emit(a, "  break;");
+    *expr = (*args)->cdr;
+    aot_compile_body(a, expr, dst);
+    a->fn->indent--;
+    emit(a, "}");
+    return true;
+  }
+
+  if (prim == prim_setq && n == 2 && type_of((*args)->car) == TSYMBOL) {
+    int bind = aot_slot(a);
+    int depth, index;
+    if (aot_lookup(a, (*args)->car, &depth, &index))
+      emit(a, "r[%d] = aot_frame_bind(%s, %d, %d);", bind, a->fn->env, depth, index);
+    else
+      emit(a, "r[%d] = aot_global_bind(%d);", bind, aot_const(a, (*args)->car));
+    int value = aot_slot(a);
+    *expr = (*args)->cdr->car;
+    aot_compile_expr(a, expr, value);
+    emit(a, "r[%d] = jit_setq(&r[%d], &r[%d]);", dst, bind, value);
+    return true;
+  }
+
+  if (prim == prim_lambda && 2 <= n && is_lambda_list((*args)->car)) {
+    DEFINE2(params, body);
+    *params = (*args)->car;
+    *body = (*args)->cdr;
+    int code = aot_compile_function(a, params, body);
+    emit(a, "r[%d] = jit_closure(%s, aot_consts[%d], aot_consts[%d], aot_index[%d]);", dst,
+         a->fn->env, aot_const(a, *params), aot_const(a, *body), code);
+    return true;
+  }
+
+  if (prim == prim_plus || (prim == prim_minus && 1 <= n)) {
+    int first = aot_compile_args(a, args);
+    emit(a, "r[%d] = %s(&r[%d], %d);", dst, prim == prim_plus ? "aot_plus" : "aot_minus", first, n);
+    return true;
+  }
+
+  if ((prim == prim_lt || prim == prim_num_eq || prim == prim_eq || prim == prim_cons ||
+       prim == prim_setcar) && n == 2) {
+    int first = aot_compile_args(a, args);
+    if (prim == prim_lt || prim == prim_num_eq)
+      emit(a, "r[%d] = %s(r[%d], r[%d]);", dst, prim == prim_lt ? "aot_lt" : "aot_num_eq", first,
+           first + 1);
+    else if (prim == prim_eq)
+      emit(a, "r[%d] = r[%d] == r[%d] ? True : Nil;", dst, first, first + 1);
+    else
+      emit(a, "r[%d] = %s(&r[%d], &r[%d]);", dst, prim == prim_cons ? "cons" : "jit_setcar", first,
+           first + 1);
+    return true;
+  }
+
+  if ((prim == prim_car || prim == prim_cdr || prim == prim_println) && n == 1) {
+    *expr = (*args)->car;
+    aot_compile_expr(a, expr, dst);
+    char *name = prim == prim_car ? "aot_car" : prim == prim_cdr ? "aot_cdr" : "jit_println";
+    emit(a, "r[%d] = %s(r[%d]);", dst, name, dst);
+    return true;
+  }
+  return false;
+}
+
+// Compiles the form guarded by the condition, so that the interpreter evaluates the form if the
+// condition does not hold at runtime.
+static void aot_begin_guard(Aot *a, char *cond) {
+  emit(a, "if (%s) {", cond);
+  a->fn->indent++;
+}
+
+static void aot_end_guard(Aot *a, Obj **form, int dst) {
+  a->fn->indent--;
+  emit(a, "} else {");
+  a->fn->indent++;
+  aot_compile_generic(a, form, dst);
+  a->fn->indent--;
+  emit(a, "}");
+}
+
+static void aot_compile_form(Aot *a, Obj **form, int dst) {
+  AotFunc *fn = a->fn;
+  int saved_slots = fn->nslots;
+  DEFINE4(head, bind, macro, expanded);
+  *head = (*form)->car;
+  char cond[64];
+  int depth, index;
+
+  if (length(*form) < 0) {
+    // Leave the error to the interpreter.
+    aot_compile_generic(a, form, dst);
+  } else if (type_of(*head) == TCELL && type_of((*head)->car) == TSYMBOL && 3 <= length(*head) &&
+             is_lambda_list((*head)->cdr->car) && !aot_lookup(a, (*head)->car, &depth, &index) &&
+             (*bind = find(a->genv, (*head)->car)) && type_of((*bind)->cdr) == TPRIMITIVE &&
+             (*bind)->cdr->fn == prim_lambda) {
+    // ((lambda ...) ...)
+    snprintf(cond, sizeof(cond), "aot_is_primitive(%d, prim_lambda)", aot_const(a, (*head)->car));
+    aot_begin_guard(a, cond);
+    aot_compile_lambda_call(a, form, dst);
+    aot_end_guard(a, form, dst);
+  } else if (type_of(*head) == TSYMBOL && aot_lookup(a, *head, &depth, &index)) {
+    // A function in a local variable
+    int f = aot_slot(a);
+    emit(a, "r[%d] = aot_frame_bind(%s, %d, %d)->cdr;", f, fn->env, depth, index);
+    snprintf(cond, sizeof(cond), "type_of(r[%d]) == TFUNCTION", f);
+    aot_begin_guard(a, cond);
+    aot_compile_call(a, f, form, dst);
+    aot_end_guard(a, form, dst);
+  } else if (type_of(*head) == TSYMBOL) {
+    int k = aot_const(a, *head);
+    *bind = find(a->genv, *head);
+    Obj *value = *bind ? (*bind)->cdr : NULL;
+    char *name = value && type_of(value) == TPRIMITIVE ? aot_primitive_name(value->fn) : NULL;
+
+    if (value && type_of(value) == TMACRO) {
+      *macro = value;
+      if (a->expanding < MAX_EXPANSION_DEPTH && aot_expand(a, form, macro, expanded)) {
+        snprintf(cond, sizeof(cond), "aot_is_macro(%d, %d)", k, aot_const(a, (*macro)->body));
+        aot_begin_guard(a, cond);
+        a->expanding++;
+        aot_compile_expr(a, expanded, dst);
+        a->expanding--;
+        aot_end_guard(a, form, dst);
+      } else {
+        aot_compile_generic(a, form, dst);
+      }
+    } else if (name) {
+      // Generate the fast path first to see if there is one.
+      FILE *out = fn->out;
+      char *buf = NULL;
+      size_t len = 0;
+      fn->out = open_memstream(&buf, &len);
+      fn->indent++;
+      bool ok = aot_compile_primitive(a, form, value->fn, dst);
+      fn->indent--;
+      fclose(fn->out);
+      fn->out = out;
+      if (ok) {
+        snprintf(cond, sizeof(cond), "aot_is_primitive(%d, %s)", k, name);
+        aot_begin_guard(a, cond);
+        fputs(buf, out);
+        aot_end_guard(a, form, dst);
+      } else {
+        aot_compile_generic(a, form, dst);
+      }
+      free(buf);
+    } else if (!value || type_of(value) == TFUNCTION) {
+      // The function may also be defined later.
+      int f = aot_slot(a);
+      snprintf(cond, sizeof(cond), "(r[%d] = aot_function(%d))", f, k);
+      aot_begin_guard(a, cond);
+      aot_compile_call(a, f, form, dst);
+      aot_end_guard(a, form, dst);
+    } else {
+      aot_compile_generic(a, form, dst);
+    }
+  } else {
+    aot_compile_generic(a, form, dst);
+  }
+  fn->nslots = saved_slots;
+}
+
+// Compiles the expression. The code stores the value to r[dst].
+static void aot_compile_expr(Aot *a, Obj **expr, int dst) {
+  int depth, index;
+  switch (type_of(*expr)) {
+  case TSYMBOL:
+    if (aot_lookup(a, *expr, &depth, &index))
+      emit(a, "r[%d] = aot_frame_bind(%s, %d, %d)->cdr;", dst, a->fn->env, depth, index);
+    else
+      emit(a, "r[%d] = aot_var(%d);", dst, aot_const(a, *expr));
+    return;
+  case TCELL:
+    aot_compile_form(a, expr, dst);
+    return;
+  case TNIL:
+    emit(a, "r[%d] = Nil;", dst);
+    return;
+  case TTRUE:
+    emit(a, "r[%d] = True;", dst);
+    return;
+  default:
+    emit(a, "r[%d] = aot_consts[%d];", dst, aot_const(a, *expr));
+  }
+}
+
+static void aot_begin_function(AotFunc *fn) {
+  *fn = (AotFunc){ .indent = 1, .nslots = 1, .max_slots = 1, .env = "env" };
+  fn->out = open_memstream(&fn->buf, &fn->len);
+}
+
+// Writes out "static Obj *name(Obj **env) {...}".
+static void aot_end_function(Aot *a, AotFunc *fn, char *name) {
+  fclose(fn->out);
+  fprintf(a->funcs, "static Obj *%s(Obj **env) {\n", name);
+  fprintf(a->funcs, "  ADD_ROOT(%d);\n  Obj **r = root_ADD_ROOT_;\n", fn->max_slots);
+  fprintf(a->funcs, "%s  return r[0];\n}\n\n", fn->buf);
+  free(fn->buf);
+}
+
+// Compiles the body of a lambda to a C function, and returns its number.
+static int aot_compile_function(Aot *a, Obj **params, Obj **body) {
+  int id = a->nfuncs++;
+  AotFunc fn, *saved_fn = a->fn;
+  DEFINE1(saved_scopes);
+  *saved_scopes = *a->scopes;
+  *a->scopes = cons(params, a->scopes);
+  a->fn = &fn;
+  aot_begin_function(&fn);
+  aot_compile_body(a, body, 0);
+  if (fn.defining) {
+    // The frame may get a new variable, so the variables cannot be accessed by position.
+    fclose(fn.out);
+    free(fn.buf);
+    aot_begin_function(&fn);
+    emit(a, "r[0] = aot_progn(env, aot_consts[%d]);", aot_const(a, *body));
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "f%d", id);
+  aot_end_function(a, &fn, name);
+  a->fn = saved_fn;
+  *a->scopes = *saved_scopes;
+  return id;
+}
+
+// Compiles a top-level form. defun and defmacro are evaluated at compile time too.
+static void aot_compile_toplevel(Aot *a, Obj **expr) {
+  DEFINE4(bind, name, params, body);
+  Obj *fn = NULL;
+  if (type_of(*expr) == TCELL && type_of((*expr)->car) == TSYMBOL && 4 <= length(*expr) &&
+      type_of((*expr)->cdr->car) == TSYMBOL && is_lambda_list((*expr)->cdr->cdr->car)) {
+    *bind = find(a->genv, (*expr)->car);
+    if (*bind && type_of((*bind)->cdr) == TPRIMITIVE &&
+        ((*bind)->cdr->fn == prim_defun || (*bind)->cdr->fn == prim_defmacro))
+      fn = (*bind)->cdr;
+  }
+  if (!fn) {
+    aot_compile_expr(a, expr, 0);
+  } else {
+    bool macro = fn->fn == prim_defmacro;
+    char cond[64];
+    snprintf(cond, sizeof(cond), "aot_is_primitive(%d, %s)", aot_const(a, (*expr)->car),
+             macro ? "prim_defmacro" : "prim_defun");
+    *name = (*expr)->cdr->car;
+    *params = (*expr)->cdr->cdr->car;
+    *body = (*expr)->cdr->cdr->cdr;
+    eval(a->genv, expr);
+    int code = macro ? -1 : aot_compile_function(a, params, body);
+    aot_begin_guard(a, cond);
+    emit(a, "r[0] = aot_define(env, %d, %d, %d, %s, %d);", aot_const(a, *name),
+         aot_const(a, *params), aot_const(a, *body), macro ? "TMACRO" : "TFUNCTION", code);
+    aot_end_guard(a, expr, 0);
+  }
+  emit(a, "jit_println(r[0]);");
+  a->fn->nslots = 1;
+}
+
+// Prints the object as a C string literal.
+static void print_c_string(char *s) {
+  printf("  \"");
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\' || *s == '?')
+      printf("\\%c", *s);
+    else if (*s == '\n')
+      printf("\\n\"\n  \"");
+    else
+      putchar(*s);
+  }
+  printf("\"");
+}
+
+// A cell in the constants, and where it was found first
+typedef struct {
+  Obj *cell;
+  Obj *parent;     // the cell whose car or cdr this is, or NULL if it's a constant itself
+  int side;        // 0 for car, 1 for cdr
+  int root;        // the index of the constant
+} ConstCell;
+
+static ConstCell *const_cells;
+static size_t const_cells_mask;
+
+static ConstCell *find_const_cell(Obj *cell) {
+  size_t i = ((uintptr_t)cell >> 4) & const_cells_mask;
+  while (const_cells[i].cell && const_cells[i].cell != cell)
+    i = (i + 1) & const_cells_mask;
+  return &const_cells[i];
+}
+
+static void add_const_cells(Obj *obj, Obj *parent, int side, int root) {
+  for (; type_of(obj) == TCELL; parent = obj, side = 1, obj = obj->cdr) {
+    ConstCell *c = find_const_cell(obj);
+    if (c->cell)
+      return;
+    *c = (ConstCell){ obj, parent, side, root };
+    add_const_cells(obj->car, obj, 0, root);
+  }
+}
+
+static int *const_sizes;
+
+static int compare_const_sizes(const void *x, const void *y) {
+  return const_sizes[*(int *)y] - const_sizes[*(int *)x];
+}
+
+// Prints the constants as ((0 . obj) ...). Many constants are parts of others, such as the forms
+// in the body of a function, so a constant contained in a larger one is printed as (1 j . path)
+// instead, where path is the list of cars (0) and cdrs (1) leading to it from the jth constant.
+// The path is packed into integers of up to 30 steps each, starting from the lowest bit and ending
+// with an extra 1 bit.
+static void print_constants(Obj *list, int n) {
+  Obj **consts = malloc(sizeof(Obj *) * n);
+  const_sizes = malloc(sizeof(int) * n);
+  int *order = malloc(sizeof(int) * n);
+  size_t total = 0;
+  for (int i = 0; i < n; i++, list = list->cdr) {
+    consts[i] = list->car;
+    const_sizes[i] = tree_size(consts[i]);
+    order[i] = i;
+    total += const_sizes[i];
+  }
+  const_cells_mask = 1;
+  while (const_cells_mask < total * 2)
+    const_cells_mask *= 2;
+  const_cells = calloc(const_cells_mask--, sizeof(ConstCell));
+
+  // Find the cells of the largest constants first.
+  qsort(order, n, sizeof(int), compare_const_sizes);
+  bool *contained = calloc(n, sizeof(bool));
+  for (int i = 0; i < n; i++) {
+    Obj *obj = consts[order[i]];
+    if (type_of(obj) == TCELL && find_const_cell(obj)->cell)
+      contained[order[i]] = true;
+    else
+      add_const_cells(obj, NULL, 0, order[i]);
+  }
+
+  fprintf(output, "(");
+  for (int i = 0; i < n; i++) {
+    if (!contained[i]) {
+      fprintf(output, "(0 . ");
+      print(consts[i]);
+      fprintf(output, ")\n");
+      continue;
+    }
+    ConstCell *c = find_const_cell(consts[i]);
+    fprintf(output, "(1 %d", c->root);
+    int len = 0;
+    for (ConstCell *p = c; p->parent; p = find_const_cell(p->parent))
+      len++;
+    char *path = malloc(len);
+    int n = len;
+    for (ConstCell *p = c; p->parent; p = find_const_cell(p->parent))
+      path[--len] = p->side;
+    for (int j = 0; j < n || j == 0; j += 30) {
+      int bits = 1;
+      for (int k = j + 30 < n ? j + 29 : n - 1; j <= k; k--)
+        bits = bits << 1 | path[k];
+      fprintf(output, " %d", bits);
+    }
+    fprintf(output, ")\n");
+    free(path);
+  }
+  fprintf(output, ")");
+  free(consts);
+  free(const_sizes);
+  free(order);
+  free(const_cells);
+  free(contained);
+}
+
+static int compile_c_main(int argc, char **argv) {
+  if (argc != 1)
+    error("Usage: minilisp --compile-c FILE");
+  input = fopen(argv[0], "r");
+  if (!input)
+    error("%s: cannot open", argv[0]);
+  // Output from the macros at compile time does not belong in the C code.
+  output = stderr;
+  init_heap();
+  DEFINE4(genv, scopes, consts, expr);
+  init_env(genv);
+  *scopes = Nil;
+  *consts = Nil;
+
+  char *funcs;
+  size_t funcs_len;
+  Aot a = { .scopes = scopes, .genv = genv, .consts = consts };
+  a.funcs = open_memstream(&funcs, &funcs_len);
+  AotFunc top;
+  a.fn = &top;
+  aot_begin_function(&top);
+  for (;;) {
+    *expr = read_expr();
+    if (!*expr)
+      break;
+    if (*expr == Cparen)
+      error("Stray close parenthesis");
+    if (*expr == Dot)
+      error("Stray dot");
+    aot_compile_toplevel(&a, expr);
+  }
+  fclose(input);
+  aot_end_function(&a, &top, "aot_main");
+  fclose(a.funcs);
+
+  printf("// Generated by \"minilisp --compile-c %s\".\n\n", argv[0]);
+  printf("#define MINILISP_AOT\n#include \"minilisp.c\"\n\n");
+  fwrite(funcs, 1, funcs_len, stdout);
+  free(funcs);
+
+  // The constants, in the order of their indices
+  printf("static char aot_src[] =\n");
+  char *buf;
+  size_t len;
+  output = open_memstream(&buf, &len);
+  print_constants(reverse(*consts), a.nconsts);
+  fclose(output);
+  print_c_string(buf);
+  printf(";\n\n");
+  free(buf);
+
+  printf("static JitCode *aot_code[] = {");
+  for (int i = 0; i < a.nfuncs; i++)
+    printf(" f%d,", i);
+  printf(" NULL };\n\n");
+  printf("static void aot_load(Obj **env) {\n");
+  printf("  aot_init(aot_src, %d, aot_code, %d);\n", a.nconsts, a.nfuncs);
+  printf("  aot_genv = env;\n");
+  printf("  aot_main(env);\n");
+  printf("}\n");
+  return 0;
+}
+
+//======================================================================
+// Entry point
+//======================================================================
+
+static void print_gc_stats(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(stderr, "GC: %d collections, %zu bytes allocated, %zu bytes copied, "
+          "%.1f us total pause, %.1f us max pause, %zu bytes peak heap, %ld KB max RSS\n",
+          gc_stats.count, gc_stats.allocated, gc_stats.copied, gc_stats.pause, gc_stats.max_pause,
+          gc_stats.peak_heap, ru.ru_maxrss);
+}
+
+// Returns true if the environment variable is defined and not the empty string.
+static bool getEnvFlag(char *name) {
+  char *val = getenv(name);
+  return val && val[0];
+}
+
+int main(int argc, char **argv) {
+  // Debug flags
+  debug_gc = getEnvFlag("MINILISP_DEBUG_GC");
+  always_gc = getEnvFlag("MINILISP_ALWAYS_GC");
+
+  // GC settings
+  char *val = getenv("MINILISP_GC");
+  if (val && strcmp(val, "incremental") == 0)
+    gc_mode = GC_INCREMENTAL;
+  else if (val && strcmp(val, "compact") == 0)
+    gc_mode = GC_COMPACT;
+  else if (val && val[0] && strcmp(val, "copying") != 0)
+    error("MINILISP_GC: unknown collector: %s", val);
+  if ((val = getenv("MINILISP_GC_PAUSE_US")))
+    gc_pause_budget = atof(val);
+  if (getEnvFlag("MINILISP_GC_STATS"))
+    atexit(print_gc_stats);
+
+  // Resource limits
+  if ((val = getenv("MINILISP_FUEL")))
+    fuel_limit = atol(val) < 0 ? 0 : atol(val);
+  if ((val = getenv("MINILISP_MAX_DEPTH")) && 0 < atoi(val))
+    depth_limit = atoi(val);
+  if ((val = getenv("MINILISP_ALLOC_QUOTA")))
+    alloc_quota = strtoull(val, NULL, 10);
+  reset_limits();
+
+#ifdef __x86_64__
+  if ((val = getenv("MINILISP_JIT"))) {
+    jit_threshold = atoi(val);
+    if (jit_threshold <= 0)
+      jit_threshold = 100;
+  }
+#endif
+
+  init_root_stack();
+  if (1 < argc && strcmp(argv[1], "--batch") == 0)
+    return batch_main(argc - 2, argv + 2);
+  if (1 < argc && strcmp(argv[1], "--compile-c") == 0)
+    return compile_c_main(argc - 2, argv + 2);
+  if (1 < argc && strcmp(argv[1], "--connect") == 0)
+    return connect_main(argc - 2, argv + 2);
+  jit_thread = jit_threshold;
+  input = stdin;
+  output = stdout;
+  if (1 < argc && strcmp(argv[1], "--serve") == 0)
+    return serve_main(argc - 2, argv + 2);
+  if ((val = getenv("MINILISP_SAMPLE_HZ")) && 0 < atoi(val))
+    start_profiler(atoi(val));
+
+  // Memory allocation
+  init_heap();
+
+  // Constants and primitives
+  DEFINE1(env);
+  // these objects will be nerver gc-ed.
+  init_env(env);
+
+#ifdef MINILISP_AOT
+  // Run the program compiled by --compile-c.
+  jit_thread = true;
+  aot_load(env);
+#else
+  // The main loop
+  eval_input(env, true);
+#endif
+  return 0;
 }
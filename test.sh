@@ -22,9 +22,13 @@ function do_run() {
 
 function run() {
   echo -n "Testing $1 ... "
-  # Run the tests twice to test the garbage collector with different settings.
+  # Run the tests several times to test the garbage collector with different settings.
   MINILISP_ALWAYS_GC= do_run "$@"
   MINILISP_ALWAYS_GC=1 do_run "$@"
+  MINILISP_GC=incremental do_run "$@"
+  MINILISP_GC=compact do_run "$@"
+  MINILISP_JIT=1 MINILISP_ALWAYS_GC=1 do_run "$@"
+  MINILISP_JIT=1 MINILISP_GC=incremental do_run "$@"
   echo ok
 }
 
@@ -79,6 +83,20 @@ run if a "(if 0 'a 'b)"
 run if a "(if 'x 'a 'b)"
 run if b "(if () 'a 'b)"
 run if c "(if () 'a 'b 'c)"
+run cond b "(cond (() 'a) (t 'b) (t 'c))"
+run cond 3 "(cond (() 'a) (3))"
+run cond '()' "(cond (() 'a))"
+run cond '()' "(cond)"
+run and 3 "(and 1 2 3)"
+run and '()' "(and 1 () (car ()))"
+run and t "(and)"
+run or 1 "(or () 1 (car ()))"
+run or '()' "(or () ())"
+run or '()' "(or)"
+run cond c "
+  (defun f (x) (cond ((eq x 'a) (and x 'b)) ((or (eq x 'b) (eq x 'c)) 'c) (t x)))
+  (f 'a) (f 'b)
+  (f 'c)"
 
 # Numeric comparisons
 run = t '(= 3 3)'
@@ -129,6 +147,30 @@ run while 45 "
     (setq i (+ i 1)))
   sum"
 
+# dotimes
+run dotimes 45 "(define sum 0) (dotimes (i 10 sum) (setq sum (+ sum i)))"
+run dotimes '()' "(dotimes (i 3) i)"
+run dotimes 0 "(dotimes (i 0 i))"
+run dotimes 5 "(dotimes (i (+ 2 3) i))"
+run dotimes '(2 1 0)' "
+  (defun f (n) (define acc ()) (dotimes (i n acc) (setq acc (cons i acc))))
+  (f 3)"
+run dotimes 4950 "
+  (defun f (n) (let ((sum 0)) (dotimes (i n sum) (setq sum (+ sum i)))))
+  (f 10) (f 100)"
+
+# Local variables
+run progn 3 "(progn 1 2 3)"
+run progn '()' "(progn)"
+run let 3 "(let ((x 1) (y 2)) (+ x y))"
+run let 1 "(define x 1) (let ((x 2) (y x)) y)"
+run let 3 "(defun f (x) (let ((y (+ x 1))) (let ((x y)) (+ x 1)))) (f 0) (f 1)"
+run let 5 "(defun mk (x) (let ((y x)) (lambda () y))) ((mk 5))"
+run let 3 "
+  (defmacro let (var val body)
+    (cons (cons 'lambda (cons (cons var ()) (cons body ()))) (cons val ())))
+  (let x 2 (+ x 1))"
+
 # Macros
 run macro 42 "
   (defun list (x . y) (cons x y))
@@ -142,6 +184,195 @@ run macroexpand '(if (= x 0) (print x))' "
   (defmacro if-zero (x then) (list 'if (list '= x 0) then))
   (macroexpand (if-zero x (print x)))"
 
+# Quasiquote
+run quasiquote '(a b)' '`(a b)'
+run quasiquote '(a 3)' '(define x 3) `(a ,x)'
+run quasiquote '(a 1 2 b)' '(define l (quote (1 2))) `(a ,@l b)'
+run quasiquote '(1 2 1 2)' '(define l (quote (1 2))) `(,@l ,@l)'
+run quasiquote '(a . 3)' '`(a . ,(+ 1 2))'
+run quasiquote '(a (quasiquote (b (unquote (c 3)))))' '(define x 3) `(a `(b ,(c ,x)))'
+run quasiquote t '(defun f (x) `(a b ,x c d)) (eq (cdr (cdr (cdr (f 1)))) (cdr (cdr (cdr (f 2)))))'
+run quasiquote 7 '(defun f (x) `(a ,(lambda () x))) ((car (cdr (f 7))))'
+run quasiquote '(if (= x 0) (print x))' '
+  (defmacro if-zero (x . then) `(if (= ,x 0) ,@then))
+  (macroexpand (if-zero x (print x)))'
+
+
+# Garbage collection
+run gc 14 "
+  (defun iota (m n) (if (< m n) (cons m (iota (+ m 1) n)) ()))
+  (define live (iota 0 100))
+  (define i 0)
+  (while (< i 2000)
+    (setq i (+ i 1))
+    (setcar (iota 0 10) live))
+  (car (cdr (cdr (car (cons (iota 12 15) live)))))"
+
+# Parallel map
+run pmap '(2 4 6)' "(pmap (lambda (x) (+ x x)) '(1 2 3))"
+run pmap '()' "(pmap (lambda (x) x) ())"
+run pmap '((1 a) (2 a))' "(define y 'a) (pmap (lambda (x) (cons x (cons y ()))) '(1 2))"
+run pmap '((11 12) (21 22))' "(pmap (lambda (x) (pmap (lambda (y) (+ x y)) '(1 2))) '(10 20))"
+run pmap 3 "((car (pmap (lambda (x) (lambda () x)) '(3 4))))"
+run pmap '(2 3 4)' "(defun f (x) (setq x (+ x 1)) x) (f 1) (pmap f '(1 2 3))"
+MINILISP_THREADS=100 run pmap '(2 3 4)' "(pmap (lambda (x) (+ x 1)) '(1 2 3))"
 
 # Sum from 0 to 10
 run recursion 55 '(defun f (x) (if (= x 0) 0 (+ (f (+ x -1)) x))) (f 10)'
+
+# JIT compiler
+run jit 101 '(defun f (x) (+ x 1)) (defun g (x) (f x)) (g 1) (defun f (x) (+ x 100)) (g 1)'
+run jit '(3 2 1)' "
+  (defmacro inc (v) (cons 'setq (cons v (cons (cons '+ (cons v (cons 1 ()))) ()))))
+  (defun count (n) ((lambda (i acc) (while (< i n) (inc i) (setq acc (cons i acc))) acc) 0 ()))
+  (count 2)
+  (count 3)"
+run jit 14 '(defun adder (n) (lambda (x) (+ x n))) (defun use (f) (f 10)) (use (adder 3)) (use (adder 4))'
+run jit 3 '(defun f (x) (define y 1) (+ x y)) (f 1) (f 2)'
+run jit -5 '(defun f (x) (- x)) (f 5)'
+run jit '(3 1)' '(defun f (x) x) (defun g () (f 1)) (g) (defun f (x . y) (cons 3 (cons x y))) (g)'
+run jit 10 '(defun f (n acc) (if (= n 0) acc (f (- n 1) (+ acc 1)))) (defun g () (f 10 0)) (g) (g)'
+
+# Optimizer
+run optimize 2 '(defmacro m () 1) (defun f () (m)) (f) (defmacro m () 2) (f)'
+run optimize -3 '(defun sq (x) (+ x x)) (defun g (y) (sq y)) (g 3) (defun sq (x) (- x)) (g 3)'
+run optimize 2 '(defun one () 1) (defun g () (one)) (g) (setq one (lambda () 2)) (g)'
+run optimize 3 '(defun f (x) ((lambda (y) (lambda () (+ x y))) 2)) ((f 1))'
+run optimize 2 '(defun one () 1) (defun mk () (lambda () (one))) (define c (mk)) (c) (defun one () 2) (c)'
+run optimize 2 '(defmacro m () 1) (defun mk () (lambda () (m))) (define c (mk)) (c) (defmacro m () 2) (c)'
+run optimize 0 '(define n 0) (defmacro m () (setq n (+ n 1)) n) (defun f (x) (if x (m) 0)) (f ()) n'
+run optimize 2 '(define n 0) (defmacro m () (setq n (+ n 1)) n) (defun f () (m)) (f) (f)'
+run optimize G__0 "(defmacro m () (cons 'quote (cons (gensym) ()))) (defun f () (m)) (f) (gensym)"
+run optimize 2 '(defun f () ((lambda (i) (setq i (+ i 1)) i) 1)) (f)'
+run optimize 6 "(defun f () (if (< 1 2) (+ 1 2 3) 'no)) (f)"
+run optimize 3 '(defun f () (if () 1 2 3)) (f)'
+run optimize 11 '(define n 10) (defun addn (x) (+ x n)) (defun g (n) (addn n)) (g 1)'
+run optimize 2 '(defmacro m () 1) (defun f (m) (m)) (f (lambda () 2))'
+run optimize t '
+  (defun ev (n) (if (= n 0) t (od (- n 1))))
+  (defun od (n) (if (= n 0) () (ev (- n 1))))
+  (ev 10)'
+run optimize 1 "(defmacro loop () '(loop)) (defun f (x) (if x 1 (loop))) (f 1)"
+
+# Frames on the root stack
+run stack-env '(1 2 3)' '(defun f (x . r) (cons x r)) (f 1 2 3)'
+run stack-env 2 '(defun f (x) (setq x (+ x 1)) x) (f 1)'
+run stack-env 5 '(defun mk (x) (lambda () x)) (defun g () ((mk 5))) (g)'
+run stack-env 300 '(defun cnt (n) (if (= n 0) 0 (+ 1 (cnt (- n 1))))) (cnt 300)'
+run stack-env '(2 1)' "
+  (defun f (x y) ((lambda (a b) (cons b (cons a ()))) x y))
+  (defun g () (define z 1) (f z (+ z 1)))
+  (g)"
+
+# Batch mode
+echo -n "Testing batch ... "
+dir=$(mktemp -d)
+echo "(define base 40)" > $dir/prelude.lisp
+echo "(setq base 1) (+ base 1)" > $dir/a.lisp
+echo "(+ base 2)" > $dir/b.lisp
+echo "(undefined)" > $dir/c.lisp
+result=$(./minilisp --batch -j 2 --prelude $dir/prelude.lisp $dir/a.lisp $dir/b.lisp $dir/c.lisp 2> /dev/null |
+           grep -v '^;; /')
+rm -rf $dir
+expected=$(printf '1\n2\n42\n;; error: Undefined symbol: undefined')
+if [ "$result" != "$expected" ]; then
+  echo FAILED
+  fail "$expected expected, but got $result"
+fi
+echo ok
+
+# Resource limits
+echo -n "Testing limits ... "
+dir=$(mktemp -d)
+echo "(while t 1)" > $dir/a.lisp
+echo "(defun f (n) (f n)) (f 1)" > $dir/b.lisp
+echo "(defun f (n) (if (= n 0) 0 (+ 1 (f (- n 1))))) (f 100)" > $dir/c.lisp
+echo "(defun f () (while t (cons 1 1))) (f)" > $dir/d.lisp
+echo "(defun f (x) (dotimes (i 400) i)) (pmap f '(1 2)) (pmap f '(1 2))" > $dir/e.lisp
+echo "(defun f (n acc) (if (= n 0) acc (f (- n 1) (cons n acc))))
+      (car (car (pmap (lambda (x) (f 200 ())) '(1 2))))" > $dir/f.lisp
+echo "(defun g (x) x) (defun f (n) (dotimes (i n) (g i))) (f 600)" > $dir/g.lisp
+echo "(defun g () 1) (defun f () (g)) (f)" > $dir/h.lisp
+result=$(MINILISP_FUEL=100000 ./minilisp --batch $dir/a.lisp 2> /dev/null
+         MINILISP_MAX_DEPTH=101 MINILISP_JIT=1 ./minilisp --batch $dir/b.lisp $dir/c.lisp 2> /dev/null
+         MINILISP_ALLOC_QUOTA=100000 ./minilisp --batch $dir/d.lisp 2> /dev/null
+         MINILISP_FUEL=1000 MINILISP_THREADS=2 ./minilisp --batch $dir/e.lisp 2> /dev/null
+         MINILISP_ALLOC_QUOTA=97000 MINILISP_THREADS=2 ./minilisp --batch $dir/f.lisp 2> /dev/null
+         MINILISP_FUEL=1000 ./minilisp --batch $dir/g.lisp 2> /dev/null
+         MINILISP_MAX_DEPTH=1 ./minilisp --batch $dir/h.lisp 2> /dev/null)
+rm -rf $dir
+result=$(echo "$result" | grep -v '^;; /')
+expected=$(printf ';; error: Fuel exhausted\n<function>\n;; error: Too deep recursion\n<function>\n100\n<function>\n;; error: Allocation quota exceeded\n<function>\n(() ())\n;; error: Fuel exhausted\n<function>\n1\n<function>\n<function>\n;; error: Fuel exhausted\n<function>\n<function>\n;; error: Too deep recursion')
+if [ "$result" != "$expected" ]; then
+  echo FAILED
+  fail "$expected expected, but got $result"
+fi
+echo ok
+
+# Sampling profiler
+echo -n "Testing profiler ... "
+file=$(mktemp)
+echo "(defun spin (n) (while (< 0 n) (setq n (- n 1)))) (defun outer () (spin 1000000)) (outer)" |
+  MINILISP_SAMPLE_HZ=1000 MINILISP_SAMPLE_FILE=$file ./minilisp > /dev/null
+result=$(grep -c '^outer[; ]' $file)
+rm -f $file
+if [ "$result" = 0 ]; then
+  echo FAILED
+  fail "no samples in outer"
+fi
+echo ok
+
+# Server mode
+echo -n "Testing serve ... "
+dir=$(mktemp -d)
+echo "(define base 40) (defun add (x) (+ base x))" > $dir/prelude.lisp
+./minilisp --serve $dir/sock --prelude $dir/prelude.lisp 2> /dev/null &
+server=$!
+for i in $(seq 50); do [ -S $dir/sock ] && break; sleep 0.1; done
+result=$( (echo "(setq base 1) (add 1)" | ./minilisp --connect $dir/sock
+           echo "(add 2) (undefined) 3" | ./minilisp --connect $dir/sock
+           echo "(pmap add '(1 2))" | ./minilisp --connect $dir/sock) 2>&1)
+kill $server
+echo keep > $dir/file
+result="$result
+$(./minilisp --serve $dir/file 2>&1; cat $dir/file)"
+rm -rf $dir
+expected=$(printf '1\n2\n42\n;; error: Undefined symbol: undefined\n(41 42)\n%s: not a socket\nkeep' $dir/file)
+if [ "$result" != "$expected" ]; then
+  echo FAILED
+  fail "$expected expected, but got $result"
+fi
+echo ok
+
+# Ahead-of-time compiler
+echo -n "Testing compile-c ... "
+dir=$(mktemp -d)
+cat > $dir/prog.lisp <<'END'
+(defun list (x . y) (cons x y))
+(defmacro unless (c . body) (cons 'if (cons c (cons () body))))
+(defun iota (m n) (unless (= m n) (cons m (iota (+ m 1) n))))
+(defun adder (n) (lambda (x) (+ x n)))
+(defun map (f l) (if l (cons (f (car l)) (map f (cdr l)))))
+(map (adder 10) (iota 0 5))
+(defun twice (x) (double x))
+(defun double (x) (+ x x))
+(twice 21)
+(defun f (x) (define y 1) (+ x y))
+(f 2)
+(defun double (x) (- x))
+(twice 21)
+(setcar '(1 2) 'a)
+(car 1)
+END
+for prog in $dir/prog.lisp examples/nqueens.lisp; do
+  ./minilisp --compile-c $prog > $dir/prog.c && cc -O2 -I. $dir/prog.c -lpthread -o $dir/prog ||
+    fail "cannot compile $prog"
+  result=$($dir/prog 2>&1)
+  expected=$(./minilisp < $prog 2>&1)
+  if [ "$result" != "$expected" ]; then
+    echo FAILED
+    fail "$expected expected, but got $result"
+  fi
+done
+rm -rf $dir
+echo ok